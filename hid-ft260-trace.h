@@ -0,0 +1,188 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * FTDI FT260 USB HID to I2C/UART host bridge tracepoints
+ *
+ * The events timing a report take its start time, and the duration is only
+ * computed when the event is enabled.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ft260
+
+#if !defined(_HID_FT260_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _HID_FT260_TRACE_H
+
+#include <linux/hid.h>
+#include <linux/ktime.h>
+#include <linux/tracepoint.h>
+
+/* A synchronous report exchange with the chip and its duration */
+DECLARE_EVENT_CLASS(ft260_report,
+	TP_PROTO(struct hid_device *hdev, u8 report_id, int len, int ret,
+		 ktime_t start),
+	TP_ARGS(hdev, report_id, len, ret, start),
+	TP_STRUCT__entry(
+		__string(name, dev_name(&hdev->dev))
+		__field(u8, report_id)
+		__field(int, len)
+		__field(int, ret)
+		__field(s64, duration_ns)
+	),
+	TP_fast_assign(
+		__assign_str(name, dev_name(&hdev->dev));
+		__entry->report_id = report_id;
+		__entry->len = len;
+		__entry->ret = ret;
+		__entry->duration_ns = ktime_to_ns(ktime_sub(ktime_get(),
+							     start));
+	),
+	TP_printk("%s rep %#02x len %d ret %d %lld ns", __get_str(name),
+		  __entry->report_id, __entry->len, __entry->ret,
+		  __entry->duration_ns)
+);
+
+DEFINE_EVENT(ft260_report, ft260_output_report,
+	TP_PROTO(struct hid_device *hdev, u8 report_id, int len, int ret,
+		 ktime_t start),
+	TP_ARGS(hdev, report_id, len, ret, start)
+);
+
+DEFINE_EVENT(ft260_report, ft260_feature_get,
+	TP_PROTO(struct hid_device *hdev, u8 report_id, int len, int ret,
+		 ktime_t start),
+	TP_ARGS(hdev, report_id, len, ret, start)
+);
+
+DEFINE_EVENT(ft260_report, ft260_feature_set,
+	TP_PROTO(struct hid_device *hdev, u8 report_id, int len, int ret,
+		 ktime_t start),
+	TP_ARGS(hdev, report_id, len, ret, start)
+);
+
+/* Completion of a report queued by the driver's own URBs */
+DECLARE_EVENT_CLASS(ft260_urb,
+	TP_PROTO(struct hid_device *hdev, u8 report_id, int len, int status),
+	TP_ARGS(hdev, report_id, len, status),
+	TP_STRUCT__entry(
+		__string(name, dev_name(&hdev->dev))
+		__field(u8, report_id)
+		__field(int, len)
+		__field(int, status)
+	),
+	TP_fast_assign(
+		__assign_str(name, dev_name(&hdev->dev));
+		__entry->report_id = report_id;
+		__entry->len = len;
+		__entry->status = status;
+	),
+	TP_printk("%s rep %#02x len %d status %d", __get_str(name),
+		  __entry->report_id, __entry->len, __entry->status)
+);
+
+DEFINE_EVENT(ft260_urb, ft260_urb_out_done,
+	TP_PROTO(struct hid_device *hdev, u8 report_id, int len, int status),
+	TP_ARGS(hdev, report_id, len, status)
+);
+
+DEFINE_EVENT(ft260_urb, ft260_ctrl_done,
+	TP_PROTO(struct hid_device *hdev, u8 report_id, int len, int status),
+	TP_ARGS(hdev, report_id, len, status)
+);
+
+TRACE_EVENT(ft260_input_report,
+	TP_PROTO(struct hid_device *hdev, u8 report_id, int len),
+	TP_ARGS(hdev, report_id, len),
+	TP_STRUCT__entry(
+		__string(name, dev_name(&hdev->dev))
+		__field(u8, report_id)
+		__field(int, len)
+	),
+	TP_fast_assign(
+		__assign_str(name, dev_name(&hdev->dev));
+		__entry->report_id = report_id;
+		__entry->len = len;
+	),
+	TP_printk("%s rep %#02x len %d", __get_str(name),
+		  __entry->report_id, __entry->len)
+);
+
+/* An I2C data or read request report, including the status wait */
+TRACE_EVENT(ft260_i2c_report,
+	TP_PROTO(struct hid_device *hdev, u8 report_id, u8 addr, int len,
+		 u8 flag, int ret, ktime_t start),
+	TP_ARGS(hdev, report_id, addr, len, flag, ret, start),
+	TP_STRUCT__entry(
+		__string(name, dev_name(&hdev->dev))
+		__field(u8, report_id)
+		__field(u8, addr)
+		__field(int, len)
+		__field(u8, flag)
+		__field(int, ret)
+		__field(s64, duration_ns)
+	),
+	TP_fast_assign(
+		__assign_str(name, dev_name(&hdev->dev));
+		__entry->report_id = report_id;
+		__entry->addr = addr;
+		__entry->len = len;
+		__entry->flag = flag;
+		__entry->ret = ret;
+		__entry->duration_ns = ktime_to_ns(ktime_sub(ktime_get(),
+							     start));
+	),
+	TP_printk("%s rep %#02x addr %#02x len %d flag %#x ret %d %lld ns",
+		  __get_str(name), __entry->report_id, __entry->addr,
+		  __entry->len, __entry->flag, __entry->ret,
+		  __entry->duration_ns)
+);
+
+TRACE_EVENT(ft260_i2c_status,
+	TP_PROTO(struct hid_device *hdev, u8 bus_status, u16 clock, int ret),
+	TP_ARGS(hdev, bus_status, clock, ret),
+	TP_STRUCT__entry(
+		__string(name, dev_name(&hdev->dev))
+		__field(u8, bus_status)
+		__field(u16, clock)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__assign_str(name, dev_name(&hdev->dev));
+		__entry->bus_status = bus_status;
+		__entry->clock = clock;
+		__entry->ret = ret;
+	),
+	TP_printk("%s bus_status %#02x clock %u ret %d", __get_str(name),
+		  __entry->bus_status, __entry->clock, __entry->ret)
+);
+
+DECLARE_EVENT_CLASS(ft260_i2c_event,
+	TP_PROTO(struct hid_device *hdev, int ret),
+	TP_ARGS(hdev, ret),
+	TP_STRUCT__entry(
+		__string(name, dev_name(&hdev->dev))
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__assign_str(name, dev_name(&hdev->dev));
+		__entry->ret = ret;
+	),
+	TP_printk("%s ret %d", __get_str(name), __entry->ret)
+);
+
+DEFINE_EVENT(ft260_i2c_event, ft260_i2c_reset,
+	TP_PROTO(struct hid_device *hdev, int ret),
+	TP_ARGS(hdev, ret)
+);
+
+DEFINE_EVENT(ft260_i2c_event, ft260_i2c_wakeup,
+	TP_PROTO(struct hid_device *hdev, int ret),
+	TP_ARGS(hdev, ret)
+);
+
+#endif /* _HID_FT260_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE hid-ft260-trace
+#include <trace/define_trace.h>
@@ -18,23 +18,148 @@
 #include <linux/kfifo.h>
 #include <linux/tty_flip.h>
 #include <linux/minmax.h>
+#include <linux/hrtimer.h>
+#include <linux/rwsem.h>
+#include <linux/uaccess.h>
+#include <linux/property.h>
+#include <linux/kthread.h>
+#include <linux/capability.h>
+#include <linux/sched.h>
+#include <linux/debugfs.h>
+#include <linux/log2.h>
+#include <linux/sizes.h>
+#include <linux/jump_label.h>
 #include <asm/unaligned.h>
 #include <linux/gpio/driver.h>
 
+#define CREATE_TRACE_POINTS
+#include "hid-ft260-trace.h"
+
+/*
+ * The debug messages are grouped in categories, each behind a static key,
+ * so the disabled ones cost a NOP on the hot paths.
+ */
+enum {
+	FT260_DBG_I2C,
+	FT260_DBG_UART,
+	FT260_DBG_GPIO,
+	FT260_DBG_CONFIG,
+	FT260_DBG_MAX,
+};
+
+#define FT260_DBG_ALL (BIT(FT260_DBG_MAX) - 1)
+
+static DEFINE_STATIC_KEY_ARRAY_FALSE(ft260_dbg_keys, FT260_DBG_MAX);
+
 #ifdef DEBUG
-static int ft260_debug = 1;
+static unsigned int ft260_debug = FT260_DBG_ALL;
 #else
-static int ft260_debug;
+static unsigned int ft260_debug;
 #endif
-module_param_named(debug, ft260_debug, int, 0600);
-MODULE_PARM_DESC(debug, "Toggle FT260 debugging messages");
 
-#define ft260_dbg(format, arg...)					  \
+static void ft260_dbg_apply(unsigned int mask)
+{
+	int i;
+
+	for (i = 0; i < FT260_DBG_MAX; i++) {
+		if (mask & BIT(i))
+			static_branch_enable(&ft260_dbg_keys[i]);
+		else
+			static_branch_disable(&ft260_dbg_keys[i]);
+	}
+}
+
+static int ft260_debug_set(const char *val, const struct kernel_param *kp)
+{
+	unsigned int mask;
+	int ret;
+
+	ret = kstrtouint(val, 0, &mask);
+	if (ret)
+		return ret;
+
+	ft260_debug = mask & FT260_DBG_ALL;
+	ft260_dbg_apply(ft260_debug);
+	return 0;
+}
+
+static const struct kernel_param_ops ft260_debug_ops = {
+	.set = ft260_debug_set,
+	.get = param_get_uint,
+};
+module_param_cb(debug, &ft260_debug_ops, &ft260_debug, 0600);
+MODULE_PARM_DESC(debug,
+		 "FT260 debugging messages bitmask: 1 - i2c, 2 - uart, 4 - gpio, 8 - config");
+
+static unsigned int rx_push_delay_us = 1000;
+module_param(rx_push_delay_us, uint, 0644);
+MODULE_PARM_DESC(rx_push_delay_us,
+		 "Default UART RX flip buffer push coalescing window in usec, 0 - push per report (max: 100000)");
+
+static unsigned int rx_push_threshold = 512;
+module_param(rx_push_threshold, uint, 0644);
+MODULE_PARM_DESC(rx_push_threshold,
+		 "Default number of received UART bytes that forces a flip buffer push (1 - 65536)");
+
+static bool low_latency;
+module_param(low_latency, bool, 0644);
+MODULE_PARM_DESC(low_latency,
+		 "Default UART low latency mode, push received data per input report and transmit from a real-time thread");
+
+static bool clock_ctl_auto;
+module_param(clock_ctl_auto, bool, 0444);
+MODULE_PARM_DESC(clock_ctl_auto,
+		 "Select the lowest system clock meeting the I2C clock and UART baud rate, until clock_ctl is written (default: false)");
+
+static bool clock_fallback;
+module_param(clock_fallback, bool, 0644);
+MODULE_PARM_DESC(clock_fallback,
+		 "Step the I2C clock of a target down on repeated bus errors, and back up after a quiet period");
+
+static unsigned int clock_fallback_quiet_ms = 10000;
+module_param(clock_fallback_quiet_ms, uint, 0644);
+MODULE_PARM_DESC(clock_fallback_quiet_ms,
+		 "Error-free period before a stepped down I2C clock is raised a step (default: 10000)");
+
+static unsigned int rx_ring_size;
+module_param(rx_ring_size, uint, 0444);
+MODULE_PARM_DESC(rx_ring_size,
+		 "Size of the UART RX staging ring used while the tty is throttled, 0 - disabled");
+
+static bool direct_urb;
+module_param(direct_urb, bool, 0444);
+MODULE_PARM_DESC(direct_urb,
+		 "Send the I2C and UART data reports via driver owned interrupt-OUT URBs");
+
+static bool async_ctrl;
+module_param(async_ctrl, bool, 0444);
+MODULE_PARM_DESC(async_ctrl,
+		 "Queue the I2C status requests as driver owned control URBs");
+
+static unsigned int rx_urbs;
+module_param(rx_urbs, uint, 0444);
+MODULE_PARM_DESC(rx_urbs,
+		 "Number of interrupt-IN URBs kept queued by the driver in place of the HID core input URB, 0 - disabled (max: 16)");
+
+static unsigned int xmit_fifo_size = PAGE_SIZE;
+module_param(xmit_fifo_size, uint, 0444);
+MODULE_PARM_DESC(xmit_fifo_size,
+		 "Size of the UART TX ring, rounded up to a power of 2 (default: PAGE_SIZE, max: 512K)");
+
+#define ft260_dbg_on(cat) static_branch_unlikely(&ft260_dbg_keys[cat])
+
+#define ft260_dbg(cat, format, arg...)					  \
 	do {								  \
-		if (ft260_debug)					  \
+		if (ft260_dbg_on(cat))					  \
 			pr_info("%s: " format, __func__, ##arg);	  \
 	} while (0)
 
+#define ft260_dbg_i2c(format, arg...) ft260_dbg(FT260_DBG_I2C, format, ##arg)
+#define ft260_dbg_uart(format, arg...) ft260_dbg(FT260_DBG_UART, format, ##arg)
+#define ft260_dbg_gpio(format, arg...) ft260_dbg(FT260_DBG_GPIO, format, ##arg)
+#define ft260_dbg_config(format, arg...) \
+	ft260_dbg(FT260_DBG_CONFIG, format, ##arg)
+
 #define FT260_REPORT_MAX_LEN (64)
 #define FT260_DATA_REPORT_ID(min, len) (min + (len - 1) / 4)
 #define FT260_I2C_DATA_REPORT_ID(len) \
@@ -270,6 +395,11 @@ struct ft260_get_uart_settings_report {
 	u8 breaking;		/* 0: no break */
 } __packed;
 
+struct ft260_get_uart_ri_dcd_status_report {
+	u8 report;		/* FT260_UART_RI_DCD_STATUS */
+	u8 dcd_ri;		/* bit 0 - DCD, bit 1 - RI */
+} __packed;
+
 struct ft260_gpio_state {
 	u8 vals;		/* GPIO[0-5] values in bits 0 - 5 */
 	u8 dirs;		/* GPIO[0-5] directions, 0 - in, 1 - out */
@@ -372,6 +502,12 @@ struct ft260_input_report {
 
 /* UART reports */
 
+struct ft260_uart_interrupt_status_report {
+	u8 report;		/* FT260_UART_INTERRUPT_STATUS */
+	u8 intr;		/* interrupt status */
+	u8 dcd_ri;		/* bit 0 - DCD, bit 1 - RI */
+} __packed;
+
 struct ft260_uart_write_request_report {
 	u8 report;		/* FT260_UART_REPORT */
 	u8 length;		/* data payload length */
@@ -391,6 +527,49 @@ struct ft260_configure_uart_request_report {
 	u8 breaking;		/* 0: no break */
 } __packed;
 
+struct ft260_set_uart_baud_rate_report {
+	u8 report;		/* FT260_SYSTEM_SETTINGS */
+	u8 request;		/* FT260_SET_UART_BAUD_RATE */
+	/* The baudrate field is unaligned */
+	__le32 baudrate;	/* little endian, 9600 = 0x2580, 19200 = 0x4B00 */
+} __packed;
+
+struct ft260_set_uart_data_bit_report {
+	u8 report;		/* FT260_SYSTEM_SETTINGS */
+	u8 request;		/* FT260_SET_UART_DATA_BIT */
+	u8 data_bit;		/* 7 or 8 */
+} __packed;
+
+struct ft260_set_uart_parity_report {
+	u8 report;		/* FT260_SYSTEM_SETTINGS */
+	u8 request;		/* FT260_SET_UART_PARITY */
+	u8 parity;		/* 0: no parity, 1: odd, 2: even, 3: high, 4: low */
+} __packed;
+
+struct ft260_set_uart_stop_bit_report {
+	u8 report;		/* FT260_SYSTEM_SETTINGS */
+	u8 request;		/* FT260_SET_UART_STOP_BIT */
+	u8 stop_bit;		/* 0: one stop bit, 2: 2 stop bits */
+} __packed;
+
+struct ft260_set_uart_breaking_report {
+	u8 report;		/* FT260_SYSTEM_SETTINGS */
+	u8 request;		/* FT260_SET_UART_BREAKING */
+	u8 breaking;		/* 0: no break, 1: break */
+} __packed;
+
+struct ft260_uart_reset_report {
+	u8 report;		/* FT260_SYSTEM_SETTINGS */
+	u8 request;		/* FT260_SET_UART_RESET */
+} __packed;
+
+struct ft260_set_uart_xon_xoff_report {
+	u8 report;		/* FT260_SYSTEM_SETTINGS */
+	u8 request;		/* FT260_SET_UART_XON_XOFF */
+	u8 xon;			/* XON character */
+	u8 xoff;		/* XOFF character */
+} __packed;
+
 /* UART interface configuration */
 enum {
 	FT260_UART_CFG_FLOW_CTRL_OFF		= 0x00,
@@ -412,16 +591,141 @@ enum {
 	FT260_UART_CFG_STOP_TWO_BIT		= 0x02,
 
 	FT260_UART_CFG_BREAKING_NO		= 0x00,
-	FT260_UART_CFG_BEAKING_YES		= 0x01,
+	FT260_UART_CFG_BREAKING_YES		= 0x01,
 
 	FT260_UART_CFG_BAUD_MIN			= 1200,
 	FT260_UART_CFG_BAUD_MAX			= 12000000,
 };
 
+/* UART modem status bits */
+enum {
+	FT260_UART_DCD				= 0x01,
+	FT260_UART_RI				= 0x02,
+};
+
+/* UART modem control pins in the GPIO[A-H] bitmap, active-low */
+enum {
+	FT260_UART_PIN_RTS	= (FT260_GPIO_B >> FT260_GPIO_MAX),
+	FT260_UART_PIN_CTS	= (FT260_GPIO_E >> FT260_GPIO_MAX),
+	FT260_UART_PIN_DTR	= (FT260_GPIO_F >> FT260_GPIO_MAX),
+	FT260_UART_PIN_DSR	= (FT260_GPIO_H >> FT260_GPIO_MAX),
+};
+
 #define FT260_UART_EN_PW_SAVE_BAUD (4800)
+#define FT260_RS485_DELAY_MAX_MS (100)
+#define FT260_RX_PUSH_DELAY_MAX_US (100000)
+#define FT260_RX_PUSH_THRESHOLD_MAX (65536) /* Default tty buffer limit */
 
 #define UART_COUNT_MAX (4) /* Number of supported UARTs */
-#define XMIT_FIFO_SIZE (PAGE_SIZE)
+#define FT260_XMIT_FIFO_MAX (SZ_512K)
+#define FT260_OUT_URBS (8) /* Data reports in flight on the direct path */
+#define FT260_OUT_URB_TIMEOUT_MS (1000)
+#define FT260_IN_URBS_MAX (16)
+#define FT260_IN_URB_ERRORS_MAX (10) /* Consecutive errors before stopping */
+#define FT260_CTRL_URBS (4) /* Feature reports in flight */
+#define FT260_UART_FRAME_MAX (4096) /* Packet mode reassembly buffer size */
+#define FT260_UART_RX_TS_RING (256) /* Power of 2 */
+#define FT260_UART_GAP_BUCKETS (32) /* log2 of the report gap in us */
+#define FT260_UART_FILL_BUCKETS (FT260_WR_UART_DATA_MAX + 1)
+#define FT260_I2C_LAT_BUCKETS (24) /* log2 of the phase latency in us */
+#define FT260_I2C_TARGETS (128) /* 7-bit addresses */
+#define FT260_FALLBACK_ERRORS (3) /* Failed transfers to step down */
+#define FT260_FLIGHT_RECORDS (256) /* Power of 2 */
+#define FT260_FLIGHT_POST (4) /* Records kept after an error or reset */
+
+/*
+ * Lock-free single producer, single consumer transmit ring. The producer is
+ * the tty write path, serialized by the line discipline, and it is the only
+ * one to advance the head. The consumer advances the tail under tx_lock.
+ */
+struct ft260_xmit_ring {
+	u8 *buf;
+	unsigned int size;	/* Power of 2 */
+	unsigned int head;
+	unsigned int tail;
+};
+
+struct ft260_uart_rx_stamp {
+	ktime_t ts;
+	u8 len;
+};
+
+enum {
+	FT260_UART_PACKET_OFF,
+	FT260_UART_PACKET_DELIM,	/* Frames end with packet_delimiter */
+	FT260_UART_PACKET_LENGTH,	/* Frames start with a length header */
+};
+
+enum {
+	FT260_I2C_PHASE_OUT,		/* Data or read request report sent */
+	FT260_I2C_PHASE_STATUS,		/* Status poll loop */
+	FT260_I2C_PHASE_READ,		/* Read data arrival */
+	FT260_I2C_PHASES,
+};
+
+/* Cumulative I2C adapter statistics, protected by the device lock */
+struct ft260_i2c_stats {
+	u64 xfers;
+	u64 msgs;
+	u64 errors;
+	u64 bytes_written;
+	u64 bytes_read;
+	u64 status_polls;
+	u64 wakeups;
+	u64 resets;
+	u64 naks;
+	u64 timeouts;
+	u64 clock_switches;
+	u64 clock_fallbacks;
+	u64 clock_recoveries;
+	u32 lat_hist[FT260_I2C_PHASES][FT260_I2C_LAT_BUCKETS];
+};
+
+/* Per target address telemetry, protected by the device lock */
+struct ft260_i2c_target {
+	u64 xfers;
+	u64 bytes_written;
+	u64 bytes_read;
+	u32 errors;
+	u32 naks;
+	u32 arb_lost;
+	u32 lat_hist[FT260_I2C_LAT_BUCKETS];
+};
+
+enum {
+	FT260_FLIGHT_I2C,
+	FT260_FLIGHT_I2C_RESET,
+	FT260_FLIGHT_UART_TX,
+	FT260_FLIGHT_UART_RX,
+};
+
+/* A flight recorder entry, see ft260_flight_record() */
+struct ft260_flight_rec {
+	ktime_t ts;
+	u32 duration_us;
+	s16 ret;
+	u16 len;
+	u8 type;
+	u8 report;
+	u8 addr;
+	u8 flag;
+	u8 status;		/* Last I2C bus status */
+	u8 retries;		/* Status polls beyond the first one */
+};
+
+/* Stepped down clock of a target, see ft260_i2c_fallback_update() */
+struct ft260_i2c_fallback {
+	u16 clock;		/* KHz, 0 - not stepped down */
+	u8 errors;		/* Consecutive failed transfers */
+	unsigned long quiet_until;
+};
+
+/* Taken at the start of a transfer to account it to its target */
+struct ft260_i2c_xfer_mark {
+	ktime_t start;
+	u64 bytes_written;
+	u64 bytes_read;
+};
 
 static const struct hid_device_id ft260_devices[] = {
 	{ HID_USB_DEVICE(USB_VENDOR_ID_FUTURE_TECHNOLOGY,
@@ -430,40 +734,192 @@ static const struct hid_device_id ft260_devices[] = {
 };
 MODULE_DEVICE_TABLE(hid, ft260_devices);
 
+/*
+ * The I2C and UART functions of one FT260 are exposed via two HID interfaces
+ * probed independently. The state that belongs to the chip rather than to
+ * an interface is kept in this reference counted object, shared by both.
+ */
+struct ft260_chip {
+	struct kref kref;
+	struct list_head list;
+	struct usb_device *udev;
+	struct ft260_get_system_status_report cfg;
+	struct mutex ctrl_lock;		/* serializes the control transfers */
+	unsigned long last_activity;
+	struct mutex gpio_lock;
+	struct hid_device *gpio_hdev;	/* interface hosting the gpio chip */
+	struct gpio_chip *gc;
+	struct ft260_gpio_state gpio;
+	u16 gpio_en;
+	u16 gpio_uart_mode[FT260_GPIO_UART_MODES];
+	struct mutex clock_lock;	/* serializes the system clock choice */
+	struct rw_semaphore traffic_lock; /* write held over a clock change */
+	struct ft260_device *uart_port;	/* UART interface, under clock_lock */
+	bool clock_auto;
+	u16 i2c_khz;			/* Fastest I2C clock configured */
+	u32 uart_baud;			/* UART baud rate while open */
+};
+
+/* Asynchronous feature report request, see ft260_ctrl_submit() */
+typedef void (*ft260_ctrl_done_t)(void *ctx, int status, u8 *data, int len);
+
+struct ft260_ctrl_urb {
+	struct urb *urb;
+	struct usb_ctrlrequest *setup;
+	u8 *buf;
+	struct ft260_device *dev;
+	ft260_ctrl_done_t done;
+	void *ctx;
+};
+
+/* Result of an asynchronous request the issuer waits for later */
+struct ft260_ctrl_result {
+	struct completion done;
+	int status;
+	u8 *data;		/* GET_REPORT destination */
+	int len;
+};
+
 struct ft260_device {
 	struct i2c_adapter adap;
 	struct hid_device *hdev;
+	struct ft260_chip *chip;
 	int iface_type;
 	int iface_id;
 	struct list_head device_list;
 	struct tty_port port;
 	/* tty port index */
 	unsigned int index;
-	struct kfifo xmit_fifo;
-	spinlock_t xmit_fifo_lock;
+	struct ft260_xmit_ring xmit;
+	bool xmit_flush;	/* Discard requested, handled under tx_lock */
+	unsigned int xmit_flush_head;	/* Ring head at the discard request */
 	struct uart_icount icount;
+	spinlock_t rx_lock;
+	struct kfifo rx_ring;
+	struct hrtimer rx_push_timer;
+	unsigned int rx_pending;
+	unsigned int rx_push_delay_us;
+	unsigned int rx_push_threshold;
+	unsigned int rx_pushes;
+	bool low_latency;
+	/* Packet mode, see ft260_uart_rx_packet() */
+	unsigned int packet_mode;
+	unsigned int packet_delimiter;
+	unsigned int packet_header;
+	unsigned int packet_timestamp;
+	u8 *rx_frame;
+	unsigned int rx_frame_len;
+	unsigned int rx_frame_skip;
+	ktime_t rx_frame_ts;
+	unsigned int rx_frames;
+	unsigned int rx_frames_dropped;
+	/* Receive timing, see ft260_uart_rx_stamp() */
+	struct ft260_uart_rx_stamp *rx_ts;	/* FT260_UART_RX_TS_RING */
+	unsigned int rx_ts_count;
+	ktime_t rx_last;
+	u32 rx_gap_hist[FT260_UART_GAP_BUCKETS];
+	u32 rx_fill_hist[FT260_UART_FILL_BUCKETS];
+	bool serdev;		/* Port is bound to a serdev controller */
+	bool flow_dtr_dsr;
+	unsigned int mctrl;	/* TIOCM_DTR and TIOCM_RTS */
+	struct serial_rs485 rs485;
+	ktime_t tx_done;	/* Estimated end of the chip transmission */
+	u8 dcd_ri;		/* Cached FT260_UART_DCD and FT260_UART_RI */
+	/* Last UART configuration programmed into the chip */
+	struct ft260_configure_uart_request_report uart_cfg;
+	bool uart_cfg_valid;
+	u8 uart_xon;
+	u8 uart_xoff;
+	struct kthread_worker *tx_worker;	/* SCHED_FIFO TX, low latency only */
+	spinlock_t tx_worker_lock;		/* Protects tx_worker */
+	struct kthread_work tx_work;
+	struct mutex tx_lock;	/* Serializes the transmitters */
 	struct timer_list wakeup_timer;
 	struct work_struct wakeup_work;
+	unsigned int keepalive_sent;
+	unsigned int keepalive_suppressed;
 	bool reschedule_work;
 	bool power_saving_en;
 	struct completion wait;
 	struct mutex lock;
 	u8 i2c_wr_buf[FT260_REPORT_MAX_LEN];
-	u8 uart_wr_buf[FT260_REPORT_MAX_LEN];
-	unsigned long need_wakeup_at;
+	u8 *uart_wr_buf;	/* Separately allocated, the report is DMA-ed */
 	u8 *read_buf;
 	u16 read_idx;
 	u16 read_len;
 	u16 clock;
-	u16 gpio_en;
-	struct gpio_chip *gc;
-	struct ft260_gpio_state gpio;
-	u16 gpio_uart_mode[FT260_GPIO_UART_MODES];
+	struct ft260_i2c_stats i2c_stats;
+	struct ft260_i2c_target *i2c_targets;
+	u16 i2c_target_clock[FT260_I2C_TARGETS];	/* KHz, 0 - default */
+	u16 i2c_clock_default;	/* KHz, set via the clock attribute */
+	u16 i2c_clock_set;	/* KHz, last requested from the chip */
+	struct ft260_i2c_fallback i2c_fallback[FT260_I2C_TARGETS];
+	u8 i2c_bus_status;	/* Error bits seen during the transfer */
+	bool i2c_wakeup;	/* Chip idle when the transfer began */
+	u8 i2c_last_status;
+	/* Flight recorder of the recent reports, see ft260_flight_record() */
+	struct ft260_flight_rec flight[FT260_FLIGHT_RECORDS];
+	atomic_t flight_idx;
+	atomic_t flight_post;	/* Records left until frozen, -1 if armed */
+	atomic_t flight_writers;	/* Records being stored */
+	bool flight_frozen;
+	struct dentry *debugfs;
+	/* Direct interrupt-OUT data path, see ft260_urb_out_init() */
+	bool urb_out_en;
+	struct urb *out_urbs[FT260_OUT_URBS];
+	struct usb_anchor out_free;
+	struct usb_anchor out_busy;
+	wait_queue_head_t out_wait;
+	int out_status;		/* First error of the reports in flight */
+	struct urb *out_chain_urb;	/* Its completion reads the I2C status */
+	struct ft260_ctrl_result *out_chain;
+	atomic64_t urb_out_sent;
+	atomic64_t urb_out_errors;
+	/* Asynchronous feature reports, see ft260_ctrl_submit() */
+	bool ctrl_en;
+	struct ft260_ctrl_urb ctrl[FT260_CTRL_URBS];
+	struct usb_anchor ctrl_free;
+	struct usb_anchor ctrl_busy;
+	wait_queue_head_t ctrl_wait;
+	atomic_t ctrl_async;	/* Completed from several CPUs */
+	u32 i2c_spec_hits;
+	u32 i2c_spec_misses;
+	/* Multi-URB receive engine, see ft260_urb_in_init() */
+	bool urb_in_en;
+	struct urb *in_urbs[FT260_IN_URBS_MAX];
+	struct usb_anchor in_anchor;
+	u32 rx_urb_interval;
+	u32 urb_in_errors;
+	atomic_t urb_in_err_run;	/* Consecutive input URB errors */
 };
 
+/*
+ * Any report exchanged with the chip keeps it out of the power saving mode,
+ * so record the time of the last one to not send needless keepalives.
+ */
+static inline void ft260_activity(struct hid_device *hdev)
+{
+	struct ft260_device *dev = hid_get_drvdata(hdev);
+
+	if (dev && dev->chip)
+		WRITE_ONCE(dev->chip->last_activity, jiffies);
+}
+
+/*
+ * The chip may have entered the power saving mode if neither interface
+ * exchanged a report with it for a while.
+ */
+static inline bool ft260_chip_idle(struct ft260_chip *chip)
+{
+	return time_is_before_jiffies(READ_ONCE(chip->last_activity) +
+			msecs_to_jiffies(FT260_WAKEUP_NEEDED_AFTER_MS));
+}
+
 static int ft260_hid_feature_report_get(struct hid_device *hdev,
 					u8 report_id, u8 *data, size_t len)
 {
+	struct ft260_device *dev = hid_get_drvdata(hdev);
+	ktime_t start;
 	u8 *buf;
 	int ret;
 
@@ -471,12 +927,18 @@ static int ft260_hid_feature_report_get(struct hid_device *hdev,
 	if (!buf)
 		return -ENOMEM;
 
+	mutex_lock(&dev->chip->ctrl_lock);
+	start = ktime_get();
 	ret = hid_hw_raw_request(hdev, report_id, buf, len, HID_FEATURE_REPORT,
 				 HID_REQ_GET_REPORT);
-	if (likely(ret == len))
+	mutex_unlock(&dev->chip->ctrl_lock);
+	trace_ft260_feature_get(hdev, report_id, len, ret, start);
+	if (likely(ret == len)) {
 		memcpy(data, buf, len);
-	else if (ret >= 0)
+		ft260_activity(hdev);
+	} else if (ret >= 0) {
 		ret = -EIO;
+	}
 	kfree(buf);
 	return ret;
 }
@@ -484,6 +946,8 @@ static int ft260_hid_feature_report_get(struct hid_device *hdev,
 static int ft260_hid_feature_report_set(struct hid_device *hdev, u8 *data,
 					size_t len)
 {
+	struct ft260_device *dev = hid_get_drvdata(hdev);
+	ktime_t start;
 	u8 *buf;
 	int ret;
 
@@ -491,15 +955,80 @@ static int ft260_hid_feature_report_set(struct hid_device *hdev, u8 *data,
 	if (!buf)
 		return -ENOMEM;
 
+	mutex_lock(&dev->chip->ctrl_lock);
+	start = ktime_get();
 	ret = hid_hw_raw_request(hdev, buf[0], buf, len, HID_FEATURE_REPORT,
 				 HID_REQ_SET_REPORT);
+	mutex_unlock(&dev->chip->ctrl_lock);
+	trace_ft260_feature_set(hdev, data[0], len, ret, start);
+	if (ret >= 0)
+		ft260_activity(hdev);
 
 	kfree(buf);
 	return ret;
 }
 
+/*
+ * The flight recorder keeps the last FT260_FLIGHT_RECORDS reports in a ring
+ * written without locks from any context, the slot being claimed by the
+ * atomic index. An error or an I2C reset freezes it FT260_FLIGHT_POST
+ * records later, so the reports around the failure survive until the ring
+ * is dumped and re-armed via debugfs. Re-arming waits for the writers that
+ * saw the ring not frozen, so no record is torn by the clearing.
+ */
+static void ft260_flight_record(struct ft260_device *dev, u8 type, u8 report,
+				u8 addr, u8 flag, int len, int ret,
+				s64 duration_ns, unsigned int retries)
+{
+	struct ft260_flight_rec *rec;
+	unsigned int idx;
+
+	atomic_inc(&dev->flight_writers);
+	smp_mb__after_atomic();
+	if (READ_ONCE(dev->flight_frozen))
+		goto exit;
+
+	idx = atomic_inc_return(&dev->flight_idx) - 1;
+	rec = &dev->flight[idx & (FT260_FLIGHT_RECORDS - 1)];
+	rec->ts = ktime_get();
+	rec->duration_us = div_s64(duration_ns, NSEC_PER_USEC);
+	rec->ret = clamp(ret, S16_MIN, S16_MAX);
+	rec->len = len;
+	rec->type = type;
+	rec->report = report;
+	rec->addr = addr;
+	rec->flag = flag;
+	rec->status = dev->i2c_last_status;
+	rec->retries = min(retries, 255U);
+
+	/* The failing record itself is counted down too */
+	if (ret < 0 || type == FT260_FLIGHT_I2C_RESET)
+		atomic_cmpxchg(&dev->flight_post, -1, FT260_FLIGHT_POST + 1);
+
+	if (atomic_read(&dev->flight_post) >= 0 &&
+	    atomic_dec_return(&dev->flight_post) <= 0)
+		WRITE_ONCE(dev->flight_frozen, true);
+exit:
+	smp_mb__before_atomic();
+	atomic_dec(&dev->flight_writers);
+}
+
+static void ft260_flight_arm(struct ft260_device *dev)
+{
+	WRITE_ONCE(dev->flight_frozen, true);
+	smp_mb();
+	while (atomic_read(&dev->flight_writers))
+		cpu_relax();
+
+	memset(dev->flight, 0, sizeof(dev->flight));
+	atomic_set(&dev->flight_idx, 0);
+	atomic_set(&dev->flight_post, -1);
+	WRITE_ONCE(dev->flight_frozen, false);
+}
+
 static int ft260_i2c_reset(struct hid_device *hdev)
 {
+	struct ft260_device *dev = hid_get_drvdata(hdev);
 	struct ft260_set_i2c_reset_report report;
 	int ret;
 
@@ -507,379 +1036,1494 @@ static int ft260_i2c_reset(struct hid_device *hdev)
 	report.request = FT260_SET_I2C_RESET;
 
 	ret = ft260_hid_feature_report_set(hdev, (u8 *)&report, sizeof(report));
+	trace_ft260_i2c_reset(hdev, ret);
+	if (dev)
+		ft260_flight_record(dev, FT260_FLIGHT_I2C_RESET, report.report,
+				    0, report.request, 0, ret, 0, 0);
 	if (ret < 0) {
 		hid_err(hdev, "failed to reset I2C controller: %d\n", ret);
 		return ret;
 	}
 
-	ft260_dbg("done\n");
+	if (dev)
+		dev->i2c_stats.resets++;
+
+	ft260_dbg_i2c("done\n");
 	return ret;
 }
 
-static int ft260_xfer_status(struct ft260_device *dev, u8 bus_busy)
+/*
+ * Asynchronous feature reports. hid_hw_raw_request() blocks the caller for
+ * every control transfer, so a few control URBs are preallocated to queue
+ * the requests back to back and to have them in flight together with the
+ * data reports. The done callback runs in the URB completion context.
+ *
+ * The submitter holds chip->ctrl_lock from the submission until the request
+ * completes, so the requests do not interleave with the synchronous feature
+ * reports of the other interface. The completion context never takes it,
+ * the task waiting for a chained request holds it on its behalf.
+ */
+static void ft260_ctrl_complete(struct urb *urb)
 {
-	struct hid_device *hdev = dev->hdev;
-	struct ft260_get_i2c_status_report report;
-	int ret;
+	struct ft260_ctrl_urb *ctrl = urb->context;
+	struct ft260_device *dev = ctrl->dev;
+	int status = urb->status;
 
-	if (time_is_before_jiffies(dev->need_wakeup_at)) {
-		ret = ft260_hid_feature_report_get(hdev, FT260_I2C_STATUS,
-						(u8 *)&report, sizeof(report));
-		if (unlikely(ret < 0)) {
-			hid_err(hdev, "failed to retrieve status: %d, no wakeup\n",
-				ret);
-		} else {
-			dev->need_wakeup_at = jiffies +
-				msecs_to_jiffies(FT260_WAKEUP_NEEDED_AFTER_MS);
-			ft260_dbg("bus_status %#02x, wakeup\n",
-				  report.bus_status);
-		}
+	trace_ft260_ctrl_done(dev->hdev, le16_to_cpu(ctrl->setup->wValue),
+			      urb->actual_length, status);
+
+	if (!status) {
+		atomic_inc(&dev->ctrl_async);
+		ft260_activity(dev->hdev);
 	}
 
-	ret = ft260_hid_feature_report_get(hdev, FT260_I2C_STATUS,
-					   (u8 *)&report, sizeof(report));
-	if (unlikely(ret < 0)) {
-		hid_err(hdev, "failed to retrieve status: %d\n", ret);
-		return ret;
+	if (ctrl->done)
+		ctrl->done(ctrl->ctx, status, ctrl->buf, urb->actual_length);
+
+	usb_anchor_urb(urb, &dev->ctrl_free);
+	wake_up(&dev->ctrl_wait);
+}
+
+static void ft260_ctrl_free(struct ft260_device *dev)
+{
+	struct ft260_ctrl_urb *ctrl;
+	int i;
+
+	dev->ctrl_en = false;
+	usb_kill_anchored_urbs(&dev->ctrl_busy);
+	usb_scuttle_anchored_urbs(&dev->ctrl_free);
+
+	for (i = 0; i < FT260_CTRL_URBS; i++) {
+		ctrl = &dev->ctrl[i];
+		usb_free_urb(ctrl->urb);
+		kfree(ctrl->setup);
+		kfree(ctrl->buf);
+		ctrl->urb = NULL;
+		ctrl->setup = NULL;
+		ctrl->buf = NULL;
 	}
+}
 
-	dev->clock = le16_to_cpu(report.clock);
-	ft260_dbg("bus_status %#02x, clock %u\n", report.bus_status,
-		  dev->clock);
+static int ft260_ctrl_init(struct ft260_device *dev)
+{
+	struct ft260_ctrl_urb *ctrl;
+	int i;
 
-	if (report.bus_status & (FT260_I2C_STATUS_CTRL_BUSY | bus_busy))
-		return -EAGAIN;
+	init_usb_anchor(&dev->ctrl_free);
+	init_usb_anchor(&dev->ctrl_busy);
+	init_waitqueue_head(&dev->ctrl_wait);
 
-	/*
-	 * The error condition (bit 1) is a status bit reflecting any
-	 * error conditions. When any of the bits 2, 3, or 4 are raised
-	 * to 1, bit 1 is also set to 1.
-	 */
-	if (report.bus_status & FT260_I2C_STATUS_ERROR) {
-		hid_err(hdev, "i2c bus error: %#02x\n", report.bus_status);
-		return -EIO;
+	if (!async_ctrl)
+		return 0;
+
+	for (i = 0; i < FT260_CTRL_URBS; i++) {
+		ctrl = &dev->ctrl[i];
+		ctrl->dev = dev;
+		ctrl->urb = usb_alloc_urb(0, GFP_KERNEL);
+		ctrl->setup = kmalloc(sizeof(*ctrl->setup), GFP_KERNEL);
+		ctrl->buf = kmalloc(FT260_REPORT_MAX_LEN, GFP_KERNEL);
+		if (!ctrl->urb || !ctrl->setup || !ctrl->buf) {
+			ft260_ctrl_free(dev);
+			return -ENOMEM;
+		}
+		ctrl->urb->context = ctrl;
+		usb_anchor_urb(ctrl->urb, &dev->ctrl_free);
 	}
 
+	dev->ctrl_en = true;
+	debugfs_create_atomic_t("ctrl_async", 0444, dev->debugfs,
+				&dev->ctrl_async);
+	debugfs_create_u32("i2c_spec_hits", 0444, dev->debugfs,
+			   &dev->i2c_spec_hits);
+	debugfs_create_u32("i2c_spec_misses", 0444, dev->debugfs,
+			   &dev->i2c_spec_misses);
 	return 0;
 }
 
-static int ft260_hid_output_report(struct hid_device *hdev, u8 *data,
-				   size_t len)
+static struct urb *ft260_ctrl_get(struct ft260_device *dev)
 {
-	u8 *buf;
+	return usb_get_from_anchor(&dev->ctrl_free);
+}
+
+static int __ft260_ctrl_submit(struct ft260_device *dev, struct urb *urb,
+			       u8 report_id, u8 *data, int len,
+			       ft260_ctrl_done_t done, void *ctx, gfp_t gfp)
+{
+	struct usb_device *udev = interface_to_usbdev(
+					to_usb_interface(dev->hdev->dev.parent));
+	struct ft260_ctrl_urb *ctrl = urb->context;
+	unsigned int pipe;
 	int ret;
 
-	buf = kmemdup(data, len, GFP_KERNEL);
-	if (!buf)
-		return -ENOMEM;
+	ctrl->done = done;
+	ctrl->ctx = ctx;
 
-	ret = hid_hw_output_report(hdev, buf, len);
+	if (data) {
+		ctrl->setup->bRequestType = FT260_SET_RQST_TYPE;
+		ctrl->setup->bRequest = FT260_SET_REPORT;
+		memcpy(ctrl->buf, data, len);
+		pipe = usb_sndctrlpipe(udev, 0);
+	} else {
+		ctrl->setup->bRequestType = FT260_GET_RQST_TYPE;
+		ctrl->setup->bRequest = FT260_GET_REPORT;
+		pipe = usb_rcvctrlpipe(udev, 0);
+	}
+	ctrl->setup->wValue = cpu_to_le16(FT260_SET_REQUEST_VALUE(report_id));
+	ctrl->setup->wIndex = cpu_to_le16(dev->iface_id);
+	ctrl->setup->wLength = cpu_to_le16(len);
+
+	usb_fill_control_urb(urb, udev, pipe, (u8 *)ctrl->setup, ctrl->buf,
+			     len, ft260_ctrl_complete, ctrl);
+
+	usb_anchor_urb(urb, &dev->ctrl_busy);
+	ret = usb_submit_urb(urb, gfp);
+	if (ret) {
+		usb_unanchor_urb(urb);
+		usb_anchor_urb(urb, &dev->ctrl_free);
+	}
+	/* Drop the reference taken by usb_get_from_anchor() */
+	usb_free_urb(urb);
 
-	kfree(buf);
 	return ret;
 }
 
-static int ft260_hid_output_report_check_status(struct ft260_device *dev,
-						u8 *data, int len)
+/*
+ * Queue a GET_REPORT (data is NULL) or SET_REPORT request of the feature
+ * report. The requests are executed in the submission order.
+ * Called with chip->ctrl_lock held.
+ */
+static int ft260_ctrl_submit(struct ft260_device *dev, u8 report_id,
+			     u8 *data, int len, ft260_ctrl_done_t done,
+			     void *ctx)
 {
-	u8 bus_busy;
-	int ret, usec, try = 100;
-	struct hid_device *hdev = dev->hdev;
-	struct ft260_i2c_write_request_report *rep =
-		(struct ft260_i2c_write_request_report *)data;
+	struct urb *urb;
 
-	ret = ft260_hid_output_report(hdev, data, len);
-	if (ret < 0) {
-		ft260_i2c_reset(hdev);
-		return ret;
-	}
+	lockdep_assert_held(&dev->chip->ctrl_lock);
 
-	/* transfer time = 1 / clock(KHz) * 9 bits * bytes */
-	usec = len * 9000 / dev->clock;
-	if (usec > 2000) {
-		usec -= 1500;
-		usleep_range(usec, usec + 100);
-		ft260_dbg("wait %d usec, len %d\n", usec, len);
-	}
+	if (!wait_event_timeout(dev->ctrl_wait, (urb = ft260_ctrl_get(dev)),
+				msecs_to_jiffies(FT260_OUT_URB_TIMEOUT_MS)))
+		return -ETIMEDOUT;
 
-	/*
-	 * Do not check the busy bit for combined transactions
-	 * since the controller keeps the bus busy between writing
-	 * and reading IOs to ensure an atomic operation.
-	 */
-	if (rep->flag == FT260_FLAG_START)
-		bus_busy = 0;
-	else
-		bus_busy = FT260_I2C_STATUS_BUS_BUSY;
+	return __ft260_ctrl_submit(dev, urb, report_id, data, len, done, ctx,
+				   GFP_KERNEL);
+}
 
-	do {
-		ret = ft260_xfer_status(dev, bus_busy);
-		if (ret != -EAGAIN)
-			break;
-	} while (--try);
+/* Same as ft260_ctrl_submit(), but for the atomic context */
+static int ft260_ctrl_submit_atomic(struct ft260_device *dev, u8 report_id,
+				    u8 *data, int len, ft260_ctrl_done_t done,
+				    void *ctx)
+{
+	struct urb *urb = ft260_ctrl_get(dev);
 
-	if (ret == 0)
-		return 0;
+	if (!urb)
+		return -EBUSY;
 
-	ft260_i2c_reset(hdev);
-	return -EIO;
+	return __ft260_ctrl_submit(dev, urb, report_id, data, len, done, ctx,
+				   GFP_ATOMIC);
 }
 
-static int ft260_i2c_write(struct ft260_device *dev, u8 addr, u8 *data,
-			   int len, u8 flag)
+static void ft260_ctrl_result_done(void *ctx, int status, u8 *data, int len)
 {
-	int ret, wr_len, idx = 0;
-	struct hid_device *hdev = dev->hdev;
-	struct ft260_i2c_write_request_report *rep =
-		(struct ft260_i2c_write_request_report *)dev->i2c_wr_buf;
+	struct ft260_ctrl_result *res = ctx;
 
-	if (len < 1)
-		return -EINVAL;
+	if (!status && res->data) {
+		if (len == res->len)
+			memcpy(res->data, data, len);
+		else
+			status = -EIO;
+	}
 
-	rep->flag = FT260_FLAG_START;
+	res->status = status;
+	complete(&res->done);
+}
 
-	do {
-		if (len <= FT260_WR_I2C_DATA_MAX) {
-			wr_len = len;
-			if (flag == FT260_FLAG_START_STOP)
-				rep->flag |= FT260_FLAG_STOP;
-		} else {
-			wr_len = FT260_WR_I2C_DATA_MAX;
-		}
+static void ft260_ctrl_result_init(struct ft260_ctrl_result *res, u8 *data,
+				   int len)
+{
+	init_completion(&res->done);
+	res->data = data;
+	res->len = len;
+}
 
-		rep->report = FT260_I2C_DATA_REPORT_ID(wr_len);
-		rep->address = addr;
-		rep->length = wr_len;
+static int ft260_ctrl_get_report_async(struct ft260_device *dev, u8 report_id,
+				       u8 *data, int len,
+				       struct ft260_ctrl_result *res)
+{
+	ft260_ctrl_result_init(res, data, len);
 
-		memcpy(rep->data, &data[idx], wr_len);
+	return ft260_ctrl_submit(dev, report_id, NULL, len,
+				 ft260_ctrl_result_done, res);
+}
 
-		ft260_dbg("rep %#02x addr %#02x off %d len %d wlen %d flag %#x d[0] %#02x\n",
-			  rep->report, addr, idx, len, wr_len,
-			  rep->flag, data[0]);
+static int ft260_ctrl_result_wait(struct ft260_device *dev,
+				  struct ft260_ctrl_result *res)
+{
+	int i;
 
-		ret = ft260_hid_output_report_check_status(dev, (u8 *)rep,
-							   wr_len + 4);
-		if (ret < 0) {
-			hid_err(hdev, "%s: failed with %d\n", __func__, ret);
-			return ret;
-		}
+	if (!wait_for_completion_timeout(&res->done,
+			msecs_to_jiffies(FT260_OUT_URB_TIMEOUT_MS))) {
+		/*
+		 * Kill the request of this result only, the killed request
+		 * completes with -ENOENT. A URB already given back and reused
+		 * carries another context and is left alone.
+		 */
+		for (i = 0; i < FT260_CTRL_URBS; i++)
+			if (READ_ONCE(dev->ctrl[i].ctx) == res)
+				usb_kill_urb(dev->ctrl[i].urb);
+		wait_for_completion(&res->done);
+		return -ETIMEDOUT;
+	}
 
-		len -= wr_len;
-		idx += wr_len;
-		rep->flag = 0;
+	return res->status;
+}
 
-	} while (len > 0);
+static int ft260_i2c_lat_bucket(ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
 
-	return 0;
+	return us > 0 ? min_t(int, ilog2(us) + 1, FT260_I2C_LAT_BUCKETS - 1) : 0;
 }
 
-static int ft260_smbus_write(struct ft260_device *dev, u8 addr, u8 cmd,
-			     u8 *data, u8 data_len, u8 flag)
+static void ft260_i2c_lat(struct ft260_device *dev, int phase, ktime_t start)
 {
-	int ret = 0;
-	int len = 4;
+	dev->i2c_stats.lat_hist[phase][ft260_i2c_lat_bucket(start)]++;
+}
 
-	struct ft260_i2c_write_request_report *rep =
-		(struct ft260_i2c_write_request_report *)dev->i2c_wr_buf;
+static void ft260_i2c_xfer_begin(struct ft260_device *dev,
+				 struct ft260_i2c_xfer_mark *mark)
+{
+	mark->start = ktime_get();
+	/*
+	 * Sample before the transfer sends its own reports, so that only the
+	 * earlier traffic of either interface suppresses the wakeup read.
+	 */
+	dev->i2c_wakeup = ft260_chip_idle(dev->chip);
+	mark->bytes_written = dev->i2c_stats.bytes_written;
+	mark->bytes_read = dev->i2c_stats.bytes_read;
+}
 
-	if (data_len >= sizeof(rep->data))
-		return -EINVAL;
+static void ft260_i2c_xfer_end(struct ft260_device *dev, u16 addr,
+			       struct ft260_i2c_xfer_mark *mark, int ret)
+{
+	struct ft260_i2c_target *t;
 
-	rep->address = addr;
-	rep->data[0] = cmd;
-	rep->length = data_len + 1;
-	rep->flag = flag;
-	len += rep->length;
+	if (!dev->i2c_targets)
+		return;
 
-	rep->report = FT260_I2C_DATA_REPORT_ID(len);
+	t = &dev->i2c_targets[addr & (FT260_I2C_TARGETS - 1)];
+	t->xfers++;
+	t->bytes_written += dev->i2c_stats.bytes_written - mark->bytes_written;
+	t->bytes_read += dev->i2c_stats.bytes_read - mark->bytes_read;
+	t->lat_hist[ft260_i2c_lat_bucket(mark->start)]++;
+	if (ret < 0)
+		t->errors++;
+	if (dev->i2c_bus_status & (FT260_I2C_STATUS_ADDR_NO_ACK |
+				   FT260_I2C_STATUS_DATA_NO_ACK))
+		t->naks++;
+	if (dev->i2c_bus_status & FT260_I2C_STATUS_ARBITR_LOST)
+		t->arb_lost++;
+}
 
-	if (data_len > 0)
-		memcpy(&rep->data[1], data, data_len);
+/* Trace and record an I2C report sent at start, with polls taken then */
+static void ft260_i2c_report_done(struct ft260_device *dev, u8 report,
+				  u8 addr, int len, u8 flag, int ret,
+				  ktime_t start, u64 polls)
+{
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	polls = dev->i2c_stats.status_polls - polls;
+	trace_ft260_i2c_report(dev->hdev, report, addr, len, flag, ret, start);
+	ft260_flight_record(dev, FT260_FLIGHT_I2C, report, addr, flag, len,
+			    ret, ns, polls > 1 ? polls - 1 : 0);
+}
 
-	ft260_dbg("rep %#02x addr %#02x cmd %#02x datlen %d replen %d\n",
-		  rep->report, addr, cmd, rep->length, len);
+static int ft260_xfer_status_check(struct ft260_device *dev,
+				   struct ft260_get_i2c_status_report *report,
+				   u8 bus_busy)
+{
+	dev->clock = le16_to_cpu(report->clock);
+	dev->i2c_last_status = report->bus_status;
+	ft260_dbg_i2c("bus_status %#02x, clock %u\n", report->bus_status,
+		      dev->clock);
+
+	if (report->bus_status & (FT260_I2C_STATUS_CTRL_BUSY | bus_busy)) {
+		trace_ft260_i2c_status(dev->hdev, report->bus_status,
+				       dev->clock, -EAGAIN);
+		return -EAGAIN;
+	}
 
-	ret = ft260_hid_output_report_check_status(dev, (u8 *)rep, len);
-	if (ret < 0)
-		hid_err(dev->hdev, "%s: failed with %d\n", __func__, ret);
+	/*
+	 * The error condition (bit 1) is a status bit reflecting any
+	 * error conditions. When any of the bits 2, 3, or 4 are raised
+	 * to 1, bit 1 is also set to 1.
+	 */
+	if (report->bus_status & FT260_I2C_STATUS_ERROR) {
+		dev->i2c_bus_status |= report->bus_status;
+		if (report->bus_status & (FT260_I2C_STATUS_ADDR_NO_ACK |
+					  FT260_I2C_STATUS_DATA_NO_ACK))
+			dev->i2c_stats.naks++;
+		hid_err(dev->hdev, "i2c bus error: %#02x\n",
+			report->bus_status);
+		trace_ft260_i2c_status(dev->hdev, report->bus_status,
+				       dev->clock, -EIO);
+		return -EIO;
+	}
 
-	return ret;
+	trace_ft260_i2c_status(dev->hdev, report->bus_status, dev->clock, 0);
+	return 0;
 }
 
-static int ft260_i2c_read(struct ft260_device *dev, u8 addr, u8 *data,
-			  u16 len, u8 flag)
+/*
+ * The wakeup and the actual status request are queued back to back, so the
+ * status is read one control transfer round trip sooner.
+ */
+static int ft260_xfer_status_wakeup(struct ft260_device *dev, u8 bus_busy)
 {
-	u16 rd_len;
-	u16 rd_data_max = 60;
-	int timeout, ret = 0;
-	struct ft260_i2c_read_request_report rep;
+	struct ft260_get_i2c_status_report wakeup, report;
+	struct ft260_ctrl_result res_wakeup, res;
 	struct hid_device *hdev = dev->hdev;
-	u8 bus_busy = 0;
+	int ret;
 
-	if ((flag & FT260_FLAG_START_REPEATED) == FT260_FLAG_START_REPEATED)
-		flag = FT260_FLAG_START_REPEATED;
+	mutex_lock(&dev->chip->ctrl_lock);
+
+	ret = ft260_ctrl_get_report_async(dev, FT260_I2C_STATUS,
+					  (u8 *)&wakeup, sizeof(wakeup),
+					  &res_wakeup);
+	if (ret < 0) {
+		mutex_unlock(&dev->chip->ctrl_lock);
+		return ret;
+	}
+
+	ret = ft260_ctrl_get_report_async(dev, FT260_I2C_STATUS,
+					  (u8 *)&report, sizeof(report), &res);
+	if (ret < 0) {
+		ft260_ctrl_result_wait(dev, &res_wakeup);
+		mutex_unlock(&dev->chip->ctrl_lock);
+		return ret;
+	}
+
+	ret = ft260_ctrl_result_wait(dev, &res_wakeup);
+	trace_ft260_i2c_wakeup(hdev, ret);
+	if (ret < 0)
+		hid_err(hdev, "failed to retrieve status, no wakeup\n");
 	else
-		flag = FT260_FLAG_START;
-	do {
-		if (len <= rd_data_max) {
-			rd_len = len;
-			flag |= FT260_FLAG_STOP;
-		} else {
-			rd_len = rd_data_max;
-		}
-		rd_data_max = FT260_RD_DATA_MAX;
+		dev->i2c_wakeup = false;
 
-		rep.report = FT260_I2C_READ_REQ;
-		rep.length = cpu_to_le16(rd_len);
-		rep.address = addr;
-		rep.flag = flag;
+	ret = ft260_ctrl_result_wait(dev, &res);
+	mutex_unlock(&dev->chip->ctrl_lock);
+	if (ret < 0) {
+		hid_err(hdev, "failed to retrieve status: %d\n", ret);
+		return ret;
+	}
 
-		ft260_dbg("rep %#02x addr %#02x len %d rlen %d flag %#x\n",
-			  rep.report, rep.address, len, rd_len, flag);
+	return ft260_xfer_status_check(dev, &report, bus_busy);
+}
 
-		reinit_completion(&dev->wait);
+static int ft260_xfer_status(struct ft260_device *dev, u8 bus_busy)
+{
+	struct hid_device *hdev = dev->hdev;
+	struct ft260_get_i2c_status_report report;
+	int ret;
 
-		dev->read_idx = 0;
-		dev->read_buf = data;
-		dev->read_len = rd_len;
+	dev->i2c_stats.status_polls++;
 
-		ret = ft260_hid_output_report(hdev, (u8 *)&rep, sizeof(rep));
-		if (ret < 0) {
-			hid_err(hdev, "%s: failed with %d\n", __func__, ret);
-			goto ft260_i2c_read_exit;
-		}
+	if (dev->i2c_wakeup) {
+		dev->i2c_stats.wakeups++;
+		if (dev->ctrl_en)
+			return ft260_xfer_status_wakeup(dev, bus_busy);
 
-		timeout = msecs_to_jiffies(5000);
-		if (!wait_for_completion_timeout(&dev->wait, timeout)) {
-			ret = -ETIMEDOUT;
-			ft260_i2c_reset(hdev);
-			goto ft260_i2c_read_exit;
+		ret = ft260_hid_feature_report_get(hdev, FT260_I2C_STATUS,
+						(u8 *)&report, sizeof(report));
+		trace_ft260_i2c_wakeup(hdev, ret);
+		if (unlikely(ret < 0)) {
+			hid_err(hdev, "failed to retrieve status: %d, no wakeup\n",
+				ret);
+		} else {
+			dev->i2c_wakeup = false;
+			ft260_dbg_i2c("bus_status %#02x, wakeup\n",
+				      report.bus_status);
 		}
+	}
 
-		dev->read_buf = NULL;
+	ret = ft260_hid_feature_report_get(hdev, FT260_I2C_STATUS,
+					   (u8 *)&report, sizeof(report));
+	if (unlikely(ret < 0)) {
+		hid_err(hdev, "failed to retrieve status: %d\n", ret);
+		return ret;
+	}
 
-		if (flag & FT260_FLAG_STOP)
-			bus_busy = FT260_I2C_STATUS_BUS_BUSY;
+	return ft260_xfer_status_check(dev, &report, bus_busy);
+}
 
-		ret = ft260_xfer_status(dev, bus_busy);
-		if (ret < 0) {
-			ret = -EIO;
-			ft260_i2c_reset(hdev);
-			goto ft260_i2c_read_exit;
-		}
+static int ft260_hid_output_report(struct hid_device *hdev, u8 *data,
+				   size_t len)
+{
+	ktime_t start;
+	u8 *buf;
+	int ret;
 
-		len -= rd_len;
-		data += rd_len;
-		flag = 0;
+	buf = kmemdup(data, len, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
 
-	} while (len > 0);
+	start = ktime_get();
+	ret = hid_hw_output_report(hdev, buf, len);
+	trace_ft260_output_report(hdev, data[0], len, ret, start);
+	if (ret >= 0)
+		ft260_activity(hdev);
 
-ft260_i2c_read_exit:
-	dev->read_buf = NULL;
+	kfree(buf);
 	return ret;
 }
 
 /*
- * A random read operation is implemented as a dummy write operation, followed
- * by a current address read operation. The dummy write operation is used to
- * load the target byte address into the current byte address counter, from
- * which the subsequent current address read operation then reads.
+ * The direct data path owns a set of preallocated interrupt-OUT URBs on the
+ * FT260 interface endpoint. Unlike hid_hw_output_report(), which waits for
+ * each report to be sent, the reports are only queued, so several of them
+ * are in flight and the endpoint can carry one report per USB frame. The
+ * completions put the URBs back to the free anchor and record the errors.
  */
-static int ft260_i2c_write_read(struct ft260_device *dev, struct i2c_msg *msgs)
+static void ft260_urb_out_complete(struct urb *urb)
 {
+	struct ft260_device *dev = urb->context;
+	struct ft260_ctrl_result *chain;
 	int ret;
-	int wr_len = msgs[0].len;
-	int rd_len = msgs[1].len;
-	struct hid_device *hdev = dev->hdev;
-	u8 addr = msgs[0].addr;
-	u16 read_off = 0;
 
-	if (wr_len > 2) {
-		hid_err(hdev, "%s: invalid wr_len: %d\n", __func__, wr_len);
-		return -EOPNOTSUPP;
+	/*
+	 * Request the I2C status as soon as the last report of a write is
+	 * accepted, without a round trip through the waiting task.
+	 */
+	if (urb == dev->out_chain_urb) {
+		chain = dev->out_chain;
+		dev->out_chain_urb = NULL;
+		ret = urb->status;
+		if (!ret)
+			ret = ft260_ctrl_submit_atomic(dev, FT260_I2C_STATUS,
+						       NULL, chain->len,
+						       ft260_ctrl_result_done,
+						       chain);
+		if (ret) {
+			chain->status = ret;
+			complete(&chain->done);
+		}
 	}
 
-	if (ft260_debug) {
-		if (wr_len == 2)
-			read_off = be16_to_cpu(*(__be16 *)msgs[0].buf);
-		else
-			read_off = *msgs[0].buf;
+	trace_ft260_urb_out_done(dev->hdev, *(u8 *)urb->transfer_buffer,
+				 urb->actual_length, urb->status);
 
-		ft260_dbg("off %#x rlen %d wlen %d\n", read_off, rd_len, wr_len);
+	switch (urb->status) {
+	case 0:
+		atomic64_inc(&dev->urb_out_sent);
+		ft260_activity(dev->hdev);
+		break;
+	case -ECONNRESET:
+	case -ENOENT:
+	case -ESHUTDOWN:
+		break;
+	default:
+		atomic64_inc(&dev->urb_out_errors);
+		cmpxchg(&dev->out_status, 0, urb->status);
+		hid_err(dev->hdev, "output report failed: %d\n", urb->status);
+		break;
 	}
 
-	ret = ft260_i2c_write(dev, addr, msgs[0].buf, wr_len,
-			      FT260_FLAG_START);
-	if (ret < 0)
-		return ret;
-
-	ret = ft260_i2c_read(dev, addr, msgs[1].buf, rd_len,
-			     FT260_FLAG_START_STOP_REPEATED);
-	if (ret < 0)
-		return ret;
+	usb_anchor_urb(urb, &dev->out_free);
+	wake_up(&dev->out_wait);
+}
 
+static int ft260_atomic64_get(void *data, u64 *val)
+{
+	*val = atomic64_read(data);
 	return 0;
 }
 
-static int ft260_i2c_xfer(struct i2c_adapter *adapter, struct i2c_msg *msgs,
-			  int num)
+DEFINE_DEBUGFS_ATTRIBUTE(ft260_atomic64_fops, ft260_atomic64_get, NULL,
+			 "%llu\n");
+
+static void ft260_urb_out_free(struct ft260_device *dev)
+{
+	struct urb *urb;
+	int i;
+
+	dev->urb_out_en = false;
+	usb_kill_anchored_urbs(&dev->out_busy);
+	usb_scuttle_anchored_urbs(&dev->out_free);
+
+	for (i = 0; i < FT260_OUT_URBS; i++) {
+		urb = dev->out_urbs[i];
+		if (!urb)
+			continue;
+		usb_free_coherent(urb->dev, FT260_REPORT_MAX_LEN,
+				  urb->transfer_buffer, urb->transfer_dma);
+		usb_free_urb(urb);
+		dev->out_urbs[i] = NULL;
+	}
+}
+
+static int ft260_urb_out_init(struct ft260_device *dev)
 {
-	int ret;
-	struct ft260_device *dev = i2c_get_adapdata(adapter);
 	struct hid_device *hdev = dev->hdev;
+	struct usb_interface *intf = to_usb_interface(hdev->dev.parent);
+	struct usb_device *udev = interface_to_usbdev(intf);
+	struct usb_endpoint_descriptor *ep;
+	struct urb *urb;
+	u8 *buf;
+	int i;
 
-	mutex_lock(&dev->lock);
+	init_usb_anchor(&dev->out_free);
+	init_usb_anchor(&dev->out_busy);
+	init_waitqueue_head(&dev->out_wait);
 
-	ret = hid_hw_power(hdev, PM_HINT_FULLON);
-	if (ret < 0) {
-		hid_err(hdev, "failed to enter FULLON power mode: %d\n", ret);
-		mutex_unlock(&dev->lock);
-		return ret;
+	if (!direct_urb)
+		return 0;
+
+	if (usb_find_int_out_endpoint(intf->cur_altsetting, &ep)) {
+		hid_info(hdev, "no interrupt-OUT endpoint, direct URBs disabled\n");
+		return 0;
 	}
 
-	if (num == 1) {
-		if (msgs->flags & I2C_M_RD)
-			ret = ft260_i2c_read(dev, msgs->addr, msgs->buf,
-					     msgs->len, FT260_FLAG_START_STOP);
-		else
-			ret = ft260_i2c_write(dev, msgs->addr, msgs->buf,
-					      msgs->len, FT260_FLAG_START_STOP);
-		if (ret < 0)
-			goto i2c_exit;
+	for (i = 0; i < FT260_OUT_URBS; i++) {
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urb)
+			goto err_free;
 
-	} else {
-		/* Combined write then read message */
-		ret = ft260_i2c_write_read(dev, msgs);
-		if (ret < 0)
-			goto i2c_exit;
+		buf = usb_alloc_coherent(udev, FT260_REPORT_MAX_LEN, GFP_KERNEL,
+					 &urb->transfer_dma);
+		if (!buf) {
+			usb_free_urb(urb);
+			goto err_free;
+		}
+
+		usb_fill_int_urb(urb, udev,
+				 usb_sndintpipe(udev, ep->bEndpointAddress),
+				 buf, FT260_REPORT_MAX_LEN,
+				 ft260_urb_out_complete, dev, ep->bInterval);
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+		dev->out_urbs[i] = urb;
+		usb_anchor_urb(urb, &dev->out_free);
 	}
 
-	ret = num;
-i2c_exit:
-	hid_hw_power(hdev, PM_HINT_NORMAL);
-	mutex_unlock(&dev->lock);
-	return ret;
+	dev->urb_out_en = true;
+	debugfs_create_file_unsafe("urb_out_sent", 0444, dev->debugfs,
+				   &dev->urb_out_sent, &ft260_atomic64_fops);
+	debugfs_create_file_unsafe("urb_out_errors", 0444, dev->debugfs,
+				   &dev->urb_out_errors, &ft260_atomic64_fops);
+	return 0;
+
+err_free:
+	ft260_urb_out_free(dev);
+	return -ENOMEM;
 }
 
-static int ft260_smbus_xfer(struct i2c_adapter *adapter, u16 addr, u16 flags,
-			    char read_write, u8 cmd, int size,
-			    union i2c_smbus_data *data)
+static int ft260_raw_event(struct hid_device *hdev, struct hid_report *report,
+			   u8 *data, int size);
+
+/*
+ * The receive engine keeps several interrupt-IN URBs queued on the endpoint,
+ * so the chip always finds a buffer to send its next report to, while the
+ * HID core has a single input URB that is resubmitted on completion. The
+ * endpoint completes the URBs in order, and each of them is fed to
+ * ft260_raw_event() and resubmitted with the current polling interval.
+ */
+static void ft260_urb_in_complete(struct urb *urb)
 {
+	struct ft260_device *dev = urb->context;
 	int ret;
-	struct ft260_device *dev = i2c_get_adapdata(adapter);
-	struct hid_device *hdev = dev->hdev;
 
-	ft260_dbg("smbus size %d\n", size);
-
-	mutex_lock(&dev->lock);
-
-	ret = hid_hw_power(hdev, PM_HINT_FULLON);
+	switch (urb->status) {
+	case 0:
+		atomic_set(&dev->urb_in_err_run, 0);
+		ft260_raw_event(dev->hdev, NULL, urb->transfer_buffer,
+				urb->actual_length);
+		break;
+	case -ECONNRESET:
+	case -ENOENT:
+	case -ESHUTDOWN:
+		return;
+	case -EPROTO:
+	case -EILSEQ:
+	case -ETIME:
+		/* Likely unplugged, do not resubmit forever, like usbhid */
+		dev->urb_in_errors++;
+		if (atomic_inc_return(&dev->urb_in_err_run) >
+		    FT260_IN_URB_ERRORS_MAX) {
+			hid_err(dev->hdev, "input URB stopped on error %d\n",
+				urb->status);
+			return;
+		}
+		break;
+	default:
+		dev->urb_in_errors++;
+		if (dev->iface_type == FT260_IFACE_UART)
+			ft260_dbg_uart("input report failed: %d\n", urb->status);
+		else
+			ft260_dbg_i2c("input report failed: %d\n", urb->status);
+		break;
+	}
+
+	urb->interval = READ_ONCE(dev->rx_urb_interval);
+	usb_anchor_urb(urb, &dev->in_anchor);
+	ret = usb_submit_urb(urb, GFP_ATOMIC);
+	if (ret) {
+		usb_unanchor_urb(urb);
+		hid_err(dev->hdev, "failed to resubmit input URB: %d\n", ret);
+	}
+}
+
+static void ft260_urb_in_free(struct ft260_device *dev)
+{
+	struct urb *urb;
+	int i;
+
+	dev->urb_in_en = false;
+	usb_kill_anchored_urbs(&dev->in_anchor);
+
+	for (i = 0; i < FT260_IN_URBS_MAX; i++) {
+		urb = dev->in_urbs[i];
+		if (!urb)
+			continue;
+		usb_free_coherent(urb->dev, urb->transfer_buffer_length,
+				  urb->transfer_buffer, urb->transfer_dma);
+		usb_free_urb(urb);
+		dev->in_urbs[i] = NULL;
+	}
+}
+
+static int ft260_rx_urb_interval_get(void *data, u64 *val)
+{
+	struct ft260_device *dev = data;
+
+	*val = READ_ONCE(dev->rx_urb_interval);
+	return 0;
+}
+
+/* The bInterval range of a full speed interrupt endpoint, in frames */
+static int ft260_rx_urb_interval_set(void *data, u64 val)
+{
+	struct ft260_device *dev = data;
+
+	WRITE_ONCE(dev->rx_urb_interval, clamp_val(val, 1, 255));
+	return 0;
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(ft260_rx_urb_interval_fops, ft260_rx_urb_interval_get,
+			 ft260_rx_urb_interval_set, "%llu\n");
+
+/*
+ * Allocate and submit rx_urbs input URBs. On success, the engine replaces
+ * the HID core input URB, so hid_hw_open() is not called.
+ */
+static int ft260_urb_in_init(struct ft260_device *dev)
+{
+	struct hid_device *hdev = dev->hdev;
+	struct usb_interface *intf = to_usb_interface(hdev->dev.parent);
+	struct usb_device *udev = interface_to_usbdev(intf);
+	struct usb_endpoint_descriptor *ep;
+	unsigned int count = min_t(unsigned int, rx_urbs, FT260_IN_URBS_MAX);
+	struct urb *urb;
+	int i, len, ret;
+	u8 *buf;
+
+	init_usb_anchor(&dev->in_anchor);
+	atomic_set(&dev->urb_in_err_run, 0);
+
+	if (!count)
+		return 0;
+
+	if (usb_find_int_in_endpoint(intf->cur_altsetting, &ep)) {
+		hid_info(hdev, "no interrupt-IN endpoint, input URBs disabled\n");
+		return 0;
+	}
+
+	len = usb_endpoint_maxp(ep);
+	dev->rx_urb_interval = ep->bInterval;
+
+	for (i = 0; i < count; i++) {
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urb) {
+			ret = -ENOMEM;
+			goto err_free;
+		}
+
+		buf = usb_alloc_coherent(udev, len, GFP_KERNEL,
+					 &urb->transfer_dma);
+		if (!buf) {
+			usb_free_urb(urb);
+			ret = -ENOMEM;
+			goto err_free;
+		}
+
+		usb_fill_int_urb(urb, udev,
+				 usb_rcvintpipe(udev, ep->bEndpointAddress),
+				 buf, len, ft260_urb_in_complete, dev,
+				 ep->bInterval);
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		dev->in_urbs[i] = urb;
+	}
+
+	for (i = 0; i < count; i++) {
+		usb_anchor_urb(dev->in_urbs[i], &dev->in_anchor);
+		ret = usb_submit_urb(dev->in_urbs[i], GFP_KERNEL);
+		if (ret) {
+			usb_unanchor_urb(dev->in_urbs[i]);
+			hid_err(hdev, "failed to submit input URB: %d\n", ret);
+			goto err_free;
+		}
+	}
+
+	dev->urb_in_en = true;
+	hid_info(hdev, "receiving via %u input URBs\n", count);
+	return 0;
+
+err_free:
+	ft260_urb_in_free(dev);
+	return ret;
+}
+
+/* Stop the input reports, started by either hid_hw_open() or the engine */
+static void ft260_hw_close(struct ft260_device *dev)
+{
+	if (dev->urb_in_en)
+		ft260_urb_in_free(dev);
+	else
+		hid_hw_close(dev->hdev);
+}
+
+/* Undo the ft260_probe() setup that precedes the interface probe */
+static void ft260_probe_cleanup(struct ft260_device *dev)
+{
+	ft260_urb_out_free(dev);
+	ft260_ctrl_free(dev);
+	debugfs_remove_recursive(dev->debugfs);
+	ft260_hw_close(dev);
+}
+
+static struct urb *ft260_urb_out_get(struct ft260_device *dev)
+{
+	return usb_get_from_anchor(&dev->out_free);
+}
+
+/*
+ * Queue the report, waiting only for a free URB. With a chain result given,
+ * the I2C status is read into it once the report is sent.
+ */
+static int ft260_urb_out_submit(struct ft260_device *dev, u8 *data, int len,
+				struct ft260_ctrl_result *chain)
+{
+	struct urb *urb;
+	int ret;
+
+	if (!wait_event_timeout(dev->out_wait, (urb = ft260_urb_out_get(dev)),
+				msecs_to_jiffies(FT260_OUT_URB_TIMEOUT_MS)))
+		return -ETIMEDOUT;
+
+	memcpy(urb->transfer_buffer, data, len);
+	urb->transfer_buffer_length = len;
+
+	if (chain) {
+		dev->out_chain = chain;
+		dev->out_chain_urb = urb;
+	}
+
+	usb_anchor_urb(urb, &dev->out_busy);
+	ret = usb_submit_urb(urb, GFP_KERNEL);
+	if (ret) {
+		dev->out_chain_urb = NULL;
+		usb_unanchor_urb(urb);
+		usb_anchor_urb(urb, &dev->out_free);
+	}
+	/* Drop the reference taken by usb_get_from_anchor() */
+	usb_free_urb(urb);
+
+	return ret;
+}
+
+/* Wait for the queued reports and return the first error among them */
+static int ft260_urb_out_wait(struct ft260_device *dev)
+{
+	if (!usb_wait_anchor_empty_timeout(&dev->out_busy,
+					   FT260_OUT_URB_TIMEOUT_MS)) {
+		usb_kill_anchored_urbs(&dev->out_busy);
+		xchg(&dev->out_status, 0);
+		return -ETIMEDOUT;
+	}
+
+	return xchg(&dev->out_status, 0);
+}
+
+/*
+ * Wait for the chip to complete the I2C write of len bytes, which ends with
+ * the report carrying the given flag.
+ */
+static int ft260_i2c_write_wait(struct ft260_device *dev, int len, u8 flag)
+{
+	u8 bus_busy;
+	int ret, usec, try = 100;
+	struct hid_device *hdev = dev->hdev;
+	ktime_t start = ktime_get();
+
+	/* transfer time = 1 / clock(KHz) * 9 bits * bytes */
+	usec = len * 9000 / dev->clock;
+	if (usec > 2000) {
+		usec -= 1500;
+		usleep_range(usec, usec + 100);
+		ft260_dbg_i2c("wait %d usec, len %d\n", usec, len);
+	}
+
+	/*
+	 * Do not check the busy bit for combined transactions
+	 * since the controller keeps the bus busy between writing
+	 * and reading IOs to ensure an atomic operation.
+	 */
+	if (flag == FT260_FLAG_START)
+		bus_busy = 0;
+	else
+		bus_busy = FT260_I2C_STATUS_BUS_BUSY;
+
+	do {
+		ret = ft260_xfer_status(dev, bus_busy);
+		if (ret != -EAGAIN)
+			break;
+	} while (--try);
+
+	ft260_i2c_lat(dev, FT260_I2C_PHASE_STATUS, start);
+
+	if (ret == 0)
+		return 0;
+
+	if (ret == -EAGAIN)
+		dev->i2c_stats.timeouts++;
+
+	ft260_i2c_reset(hdev);
+	return -EIO;
+}
+
+static int ft260_hid_output_report_check_status(struct ft260_device *dev,
+						u8 *data, int len)
+{
+	int ret;
+	struct hid_device *hdev = dev->hdev;
+	struct ft260_i2c_write_request_report *rep =
+		(struct ft260_i2c_write_request_report *)data;
+	u64 polls = dev->i2c_stats.status_polls;
+	ktime_t start = ktime_get();
+
+	ret = ft260_hid_output_report(hdev, data, len);
+	ft260_i2c_lat(dev, FT260_I2C_PHASE_OUT, start);
+	if (ret < 0)
+		ft260_i2c_reset(hdev);
+	else
+		ret = ft260_i2c_write_wait(dev, len, rep->flag);
+
+	ft260_i2c_report_done(dev, rep->report, rep->address, rep->length,
+			      rep->flag, ret, start, polls);
+	return ret;
+}
+
+/*
+ * Check the bus for an error while the reports of a write are still queued.
+ * A busy controller has not completed the data yet, which is no error.
+ */
+static int ft260_i2c_write_error(struct ft260_device *dev)
+{
+	struct ft260_get_i2c_status_report report;
+	int ret;
+
+	dev->i2c_stats.status_polls++;
+	ret = ft260_hid_feature_report_get(dev->hdev, FT260_I2C_STATUS,
+					   (u8 *)&report, sizeof(report));
+	if (ret < 0)
+		return ret;
+
+	ret = ft260_xfer_status_check(dev, &report, 0);
+	return ret == -EAGAIN ? 0 : ret;
+}
+
+/*
+ * With the direct URBs, the reports of a multi-report write are queued back
+ * to back, and the bus is checked for an error once per FT260_OUT_URBS
+ * reports, so a NAK stops the write within that many reports without
+ * draining the queue before each one. The chip throttles the reports on the
+ * endpoint while it is clocking out the data.
+ */
+static int ft260_i2c_write_urb(struct ft260_device *dev, u8 addr, u8 *data,
+			       int len, u8 flag)
+{
+	int ret, wr_len, idx = 0, nr = 0;
+	struct hid_device *hdev = dev->hdev;
+	struct ft260_i2c_write_request_report *rep =
+		(struct ft260_i2c_write_request_report *)dev->i2c_wr_buf;
+	struct ft260_get_i2c_status_report status;
+	struct ft260_ctrl_result res, *chain;
+	u64 polls = dev->i2c_stats.status_polls;
+	ktime_t start = ktime_get(), status_start;
+	bool spec = false;
+	int out_ret;
+	u8 last_flag;
+
+	rep->flag = FT260_FLAG_START;
+
+	do {
+		/*
+		 * Do not queue more data after a failed report or a NAK of
+		 * the data queued so far.
+		 */
+		if (idx) {
+			ret = READ_ONCE(dev->out_status);
+			if (!ret && !(nr % FT260_OUT_URBS))
+				ret = ft260_i2c_write_error(dev);
+			if (ret < 0)
+				break;
+		}
+
+		if (len <= FT260_WR_I2C_DATA_MAX) {
+			wr_len = len;
+			if (flag == FT260_FLAG_START_STOP)
+				rep->flag |= FT260_FLAG_STOP;
+		} else {
+			wr_len = FT260_WR_I2C_DATA_MAX;
+		}
+
+		rep->report = FT260_I2C_DATA_REPORT_ID(wr_len);
+		rep->address = addr;
+		rep->length = wr_len;
+
+		memcpy(rep->data, &data[idx], wr_len);
+
+		/*
+		 * A short last report is likely on the bus by the time its
+		 * status is read, so read it speculatively, see
+		 * ft260_urb_out_complete(). Otherwise, or if the bus is still
+		 * busy, ft260_i2c_write_wait() polls as usual.
+		 */
+		chain = NULL;
+		if (len == wr_len && dev->ctrl_en &&
+		    (wr_len + 4) * 9000 / dev->clock <= 2000 &&
+		    !dev->i2c_wakeup) {
+			ft260_ctrl_result_init(&res, (u8 *)&status,
+					       sizeof(status));
+			chain = &res;
+		}
+
+		/* Held until the chained status request completes */
+		if (chain)
+			mutex_lock(&dev->chip->ctrl_lock);
+
+		ret = ft260_urb_out_submit(dev, (u8 *)rep, wr_len + 4, chain);
+		/* The last report is recorded with the status polls it took */
+		if (ret < 0 || len != wr_len)
+			ft260_i2c_report_done(dev, rep->report, addr, wr_len,
+					      rep->flag, ret, start, polls);
+		if (ret < 0) {
+			if (chain)
+				mutex_unlock(&dev->chip->ctrl_lock);
+			break;
+		}
+		spec = chain;
+
+		len -= wr_len;
+		idx += wr_len;
+		nr++;
+		last_flag = rep->flag;
+		rep->flag = 0;
+
+	} while (len > 0);
+
+	out_ret = ft260_urb_out_wait(dev);
+	ft260_i2c_lat(dev, FT260_I2C_PHASE_OUT, start);
+	if (out_ret < 0 || ret < 0) {
+		if (spec) {
+			ft260_ctrl_result_wait(dev, &res);
+			mutex_unlock(&dev->chip->ctrl_lock);
+		}
+		if (out_ret == -ETIMEDOUT || ret == -ETIMEDOUT)
+			dev->i2c_stats.timeouts++;
+		hid_err(hdev, "%s: failed with %d\n", __func__,
+			ret < 0 ? ret : out_ret);
+		ft260_i2c_reset(hdev);
+		if (ret < 0)
+			return ret;
+		ret = -EIO;
+		goto exit;
+	}
+
+	if (spec) {
+		status_start = ktime_get();
+		dev->i2c_stats.status_polls++;
+		ret = ft260_ctrl_result_wait(dev, &res);
+		mutex_unlock(&dev->chip->ctrl_lock);
+		if (!ret)
+			ret = ft260_xfer_status_check(dev, &status,
+				last_flag == FT260_FLAG_START ?
+				0 : FT260_I2C_STATUS_BUS_BUSY);
+		ft260_i2c_lat(dev, FT260_I2C_PHASE_STATUS, status_start);
+		if (!ret) {
+			dev->i2c_spec_hits++;
+			goto exit;
+		}
+		dev->i2c_spec_misses++;
+		/* A bus error is final, no need to poll it again */
+		if (ret == -EIO) {
+			ft260_i2c_reset(hdev);
+			goto exit;
+		}
+	}
+
+	ret = ft260_i2c_write_wait(dev, wr_len + 4, last_flag);
+exit:
+	ft260_i2c_report_done(dev, rep->report, addr, wr_len, last_flag, ret,
+			      start, polls);
+	return ret;
+}
+
+static int ft260_i2c_write(struct ft260_device *dev, u8 addr, u8 *data,
+			   int len, u8 flag)
+{
+	int ret, wr_len, idx = 0;
+	struct hid_device *hdev = dev->hdev;
+	struct ft260_i2c_write_request_report *rep =
+		(struct ft260_i2c_write_request_report *)dev->i2c_wr_buf;
+
+	if (len < 1)
+		return -EINVAL;
+
+	dev->i2c_stats.bytes_written += len;
+
+	if (dev->urb_out_en)
+		return ft260_i2c_write_urb(dev, addr, data, len, flag);
+
+	rep->flag = FT260_FLAG_START;
+
+	do {
+		if (len <= FT260_WR_I2C_DATA_MAX) {
+			wr_len = len;
+			if (flag == FT260_FLAG_START_STOP)
+				rep->flag |= FT260_FLAG_STOP;
+		} else {
+			wr_len = FT260_WR_I2C_DATA_MAX;
+		}
+
+		rep->report = FT260_I2C_DATA_REPORT_ID(wr_len);
+		rep->address = addr;
+		rep->length = wr_len;
+
+		memcpy(rep->data, &data[idx], wr_len);
+
+		ft260_dbg_i2c("rep %#02x addr %#02x off %d len %d wlen %d flag %#x d[0] %#02x\n",
+			      rep->report, addr, idx, len, wr_len,
+			      rep->flag, data[0]);
+
+		ret = ft260_hid_output_report_check_status(dev, (u8 *)rep,
+							   wr_len + 4);
+		if (ret < 0) {
+			hid_err(hdev, "%s: failed with %d\n", __func__, ret);
+			return ret;
+		}
+
+		len -= wr_len;
+		idx += wr_len;
+		rep->flag = 0;
+
+	} while (len > 0);
+
+	return 0;
+}
+
+static int ft260_smbus_write(struct ft260_device *dev, u8 addr, u8 cmd,
+			     u8 *data, u8 data_len, u8 flag)
+{
+	int ret = 0;
+	int len = 4;
+
+	struct ft260_i2c_write_request_report *rep =
+		(struct ft260_i2c_write_request_report *)dev->i2c_wr_buf;
+
+	if (data_len >= sizeof(rep->data))
+		return -EINVAL;
+
+	rep->address = addr;
+	rep->data[0] = cmd;
+	rep->length = data_len + 1;
+	rep->flag = flag;
+	len += rep->length;
+
+	rep->report = FT260_I2C_DATA_REPORT_ID(len);
+
+	if (data_len > 0)
+		memcpy(&rep->data[1], data, data_len);
+
+	dev->i2c_stats.bytes_written += rep->length;
+
+	ft260_dbg_i2c("rep %#02x addr %#02x cmd %#02x datlen %d replen %d\n",
+		      rep->report, addr, cmd, rep->length, len);
+
+	ret = ft260_hid_output_report_check_status(dev, (u8 *)rep, len);
+	if (ret < 0)
+		hid_err(dev->hdev, "%s: failed with %d\n", __func__, ret);
+
+	return ret;
+}
+
+static int ft260_i2c_read(struct ft260_device *dev, u8 addr, u8 *data,
+			  u16 len, u8 flag)
+{
+	u16 rd_len;
+	u16 rd_data_max = 60;
+	int timeout, ret = 0;
+	struct ft260_i2c_read_request_report rep;
+	struct hid_device *hdev = dev->hdev;
+	u8 bus_busy = 0;
+	ktime_t start, req_start;
+	u64 polls;
+
+	if ((flag & FT260_FLAG_START_REPEATED) == FT260_FLAG_START_REPEATED)
+		flag = FT260_FLAG_START_REPEATED;
+	else
+		flag = FT260_FLAG_START;
+	do {
+		if (len <= rd_data_max) {
+			rd_len = len;
+			flag |= FT260_FLAG_STOP;
+		} else {
+			rd_len = rd_data_max;
+		}
+		rd_data_max = FT260_RD_DATA_MAX;
+
+		rep.report = FT260_I2C_READ_REQ;
+		rep.length = cpu_to_le16(rd_len);
+		rep.address = addr;
+		rep.flag = flag;
+
+		ft260_dbg_i2c("rep %#02x addr %#02x len %d rlen %d flag %#x\n",
+			      rep.report, rep.address, len, rd_len, flag);
+
+		reinit_completion(&dev->wait);
+
+		dev->read_idx = 0;
+		dev->read_buf = data;
+		dev->read_len = rd_len;
+
+		polls = dev->i2c_stats.status_polls;
+		req_start = start = ktime_get();
+		ret = ft260_hid_output_report(hdev, (u8 *)&rep, sizeof(rep));
+		ft260_i2c_lat(dev, FT260_I2C_PHASE_OUT, start);
+		if (ret < 0) {
+			hid_err(hdev, "%s: failed with %d\n", __func__, ret);
+			goto ft260_i2c_read_exit;
+		}
+
+		start = ktime_get();
+		timeout = msecs_to_jiffies(5000);
+		if (!wait_for_completion_timeout(&dev->wait, timeout)) {
+			ret = -ETIMEDOUT;
+			dev->i2c_stats.timeouts++;
+			ft260_i2c_report_done(dev, rep.report, addr, rd_len,
+					      flag, ret, req_start, polls);
+			ft260_i2c_reset(hdev);
+			goto ft260_i2c_read_exit;
+		}
+		ft260_i2c_lat(dev, FT260_I2C_PHASE_READ, start);
+
+		dev->read_buf = NULL;
+		dev->i2c_stats.bytes_read += rd_len;
+
+		if (flag & FT260_FLAG_STOP)
+			bus_busy = FT260_I2C_STATUS_BUS_BUSY;
+
+		start = ktime_get();
+		ret = ft260_xfer_status(dev, bus_busy);
+		ft260_i2c_lat(dev, FT260_I2C_PHASE_STATUS, start);
+		ft260_i2c_report_done(dev, rep.report, addr, rd_len, flag, ret,
+				      req_start, polls);
+		if (ret < 0) {
+			ret = -EIO;
+			ft260_i2c_reset(hdev);
+			goto ft260_i2c_read_exit;
+		}
+
+		len -= rd_len;
+		data += rd_len;
+		flag = 0;
+
+	} while (len > 0);
+
+ft260_i2c_read_exit:
+	dev->read_buf = NULL;
+	return ret;
+}
+
+/*
+ * A random read operation is implemented as a dummy write operation, followed
+ * by a current address read operation. The dummy write operation is used to
+ * load the target byte address into the current byte address counter, from
+ * which the subsequent current address read operation then reads.
+ */
+static int ft260_i2c_write_read(struct ft260_device *dev, struct i2c_msg *msgs)
+{
+	int ret;
+	int wr_len = msgs[0].len;
+	int rd_len = msgs[1].len;
+	struct hid_device *hdev = dev->hdev;
+	u8 addr = msgs[0].addr;
+	u16 read_off = 0;
+
+	if (wr_len > 2) {
+		hid_err(hdev, "%s: invalid wr_len: %d\n", __func__, wr_len);
+		return -EOPNOTSUPP;
+	}
+
+	if (ft260_dbg_on(FT260_DBG_I2C)) {
+		if (wr_len == 2)
+			read_off = be16_to_cpu(*(__be16 *)msgs[0].buf);
+		else
+			read_off = *msgs[0].buf;
+
+		ft260_dbg_i2c("off %#x rlen %d wlen %d\n", read_off, rd_len, wr_len);
+	}
+
+	ret = ft260_i2c_write(dev, addr, msgs[0].buf, wr_len,
+			      FT260_FLAG_START);
+	if (ret < 0)
+		return ret;
+
+	ret = ft260_i2c_read(dev, addr, msgs[1].buf, rd_len,
+			     FT260_FLAG_START_STOP_REPEATED);
+	if (ret < 0)
+		return ret;
+
+	return 0;
+}
+
+static const u16 ft260_i2c_clock_steps[] = { 60, 100, 400, 1000, 3400 };
+
+static u16 ft260_i2c_target_clock(struct ft260_device *dev, u16 addr)
+{
+	u16 clock = dev->i2c_target_clock[addr];
+
+	if (!clock)
+		clock = dev->i2c_clock_default;
+	return clock ?: dev->clock;
+}
+
+static void ft260_i2c_fallback_notify(struct ft260_device *dev, u16 addr,
+				      u16 clock)
+{
+	char addr_env[24], clock_env[24];
+	char *envp[] = { addr_env, clock_env, NULL };
+
+	snprintf(addr_env, sizeof(addr_env), "FT260_I2C_ADDR=%#04x", addr);
+	snprintf(clock_env, sizeof(clock_env), "FT260_I2C_CLOCK=%u", clock);
+	kobject_uevent_env(&dev->hdev->dev.kobj, KOBJ_CHANGE, envp);
+}
+
+/*
+ * With clock_fallback, a target failing FT260_FALLBACK_ERRORS transfers in
+ * a row with bus errors other than the address NAK is moved to the next
+ * lower clock step. Returns true if the failed transfer is worth a retry.
+ */
+static bool ft260_i2c_fallback_update(struct ft260_device *dev, u16 addr,
+				      int ret)
+{
+	struct ft260_i2c_fallback *fb;
+	u8 status = dev->i2c_bus_status;
+	u16 clock;
+	int i;
+
+	if (!clock_fallback)
+		return false;
+
+	addr &= FT260_I2C_TARGETS - 1;
+	fb = &dev->i2c_fallback[addr];
+
+	if (ret >= 0) {
+		fb->errors = 0;
+		return false;
+	}
+
+	/* A lone address NAK is an absent target, not a marginal bus */
+	if (!(status & (FT260_I2C_STATUS_DATA_NO_ACK |
+			FT260_I2C_STATUS_ARBITR_LOST)) &&
+	    (!(status & FT260_I2C_STATUS_ERROR) ||
+	     status & FT260_I2C_STATUS_ADDR_NO_ACK))
+		return false;
+
+	/* Any bus error restarts the quiet period of a stepped down clock */
+	fb->quiet_until = jiffies + msecs_to_jiffies(clock_fallback_quiet_ms);
+
+	if (++fb->errors < FT260_FALLBACK_ERRORS)
+		return false;
+
+	fb->errors = 0;
+
+	clock = fb->clock ?: ft260_i2c_target_clock(dev, addr);
+	for (i = ARRAY_SIZE(ft260_i2c_clock_steps) - 1; i >= 0; i--)
+		if (ft260_i2c_clock_steps[i] < clock)
+			break;
+	if (i < 0)
+		return false;
+
+	fb->clock = ft260_i2c_clock_steps[i];
+	dev->i2c_stats.clock_fallbacks++;
+	hid_warn(dev->hdev, "i2c errors at %#02x, clock %u -> %u\n", addr,
+		 clock, fb->clock);
+	ft260_i2c_fallback_notify(dev, addr, fb->clock);
+	return true;
+}
+
+/* Raise a stepped down clock by a step after the quiet period */
+static u16 ft260_i2c_fallback_clock(struct ft260_device *dev, u16 addr,
+				    u16 clock)
+{
+	struct ft260_i2c_fallback *fb = &dev->i2c_fallback[addr];
+	int i;
+
+	if (!fb->clock)
+		return clock;
+
+	if (time_after(jiffies, fb->quiet_until)) {
+		for (i = 0; i < ARRAY_SIZE(ft260_i2c_clock_steps); i++)
+			if (ft260_i2c_clock_steps[i] > fb->clock)
+				break;
+		if (i == ARRAY_SIZE(ft260_i2c_clock_steps) ||
+		    ft260_i2c_clock_steps[i] >= clock)
+			fb->clock = 0;
+		else
+			fb->clock = ft260_i2c_clock_steps[i];
+		fb->quiet_until = jiffies +
+				  msecs_to_jiffies(clock_fallback_quiet_ms);
+		dev->i2c_stats.clock_recoveries++;
+		ft260_i2c_fallback_notify(dev, addr, fb->clock ?: clock);
+	}
+
+	return fb->clock ? min(fb->clock, clock) : clock;
+}
+
+/*
+ * Switch the bus clock to the one of the target, or back to the default,
+ * only when it differs from the current one.
+ */
+static int ft260_i2c_clock_select(struct ft260_device *dev, u16 addr)
+{
+	struct ft260_set_i2c_speed_report rep;
+	u16 clock;
+	int ret;
+
+	addr &= FT260_I2C_TARGETS - 1;
+	clock = ft260_i2c_fallback_clock(dev, addr,
+					 ft260_i2c_target_clock(dev, addr));
+	/* dev->clock is the one the chip reports, which may be rounded */
+	if (!clock || clock == dev->i2c_clock_set)
+		return 0;
+
+	rep.report = FT260_SYSTEM_SETTINGS;
+	rep.request = FT260_SET_I2C_CLOCK_SPEED;
+	rep.clock = cpu_to_le16(clock);
+
+	ret = ft260_hid_feature_report_set(dev->hdev, (u8 *)&rep, sizeof(rep));
+	if (ret < 0) {
+		hid_err(dev->hdev, "failed to set clock %u for %#02x: %d\n",
+			clock, addr, ret);
+		return ret;
+	}
+
+	ft260_dbg_i2c("clock %u -> %u for %#02x\n", dev->i2c_clock_set, clock,
+		      addr);
+	dev->clock = clock;
+	dev->i2c_clock_set = clock;
+	dev->i2c_stats.clock_switches++;
+	return 0;
+}
+
+static int ft260_i2c_xfer(struct i2c_adapter *adapter, struct i2c_msg *msgs,
+			  int num)
+{
+	int ret;
+	struct ft260_device *dev = i2c_get_adapdata(adapter);
+	struct hid_device *hdev = dev->hdev;
+	struct ft260_i2c_xfer_mark mark;
+	bool retried = false;
+
+	mutex_lock(&dev->lock);
+
+	ret = hid_hw_power(hdev, PM_HINT_FULLON);
+	if (ret < 0) {
+		hid_err(hdev, "failed to enter FULLON power mode: %d\n", ret);
+		mutex_unlock(&dev->lock);
+		return ret;
+	}
+
+	down_read(&dev->chip->traffic_lock);
+	ft260_i2c_xfer_begin(dev, &mark);
+retry:
+	dev->i2c_bus_status = 0;
+	ret = ft260_i2c_clock_select(dev, msgs[0].addr);
+	if (ret < 0)
+		goto i2c_exit;
+
+	if (num == 1) {
+		if (msgs->flags & I2C_M_RD)
+			ret = ft260_i2c_read(dev, msgs->addr, msgs->buf,
+					     msgs->len, FT260_FLAG_START_STOP);
+		else
+			ret = ft260_i2c_write(dev, msgs->addr, msgs->buf,
+					      msgs->len, FT260_FLAG_START_STOP);
+		if (ret < 0)
+			goto i2c_exit;
+
+	} else {
+		/* Combined write then read message */
+		ret = ft260_i2c_write_read(dev, msgs);
+		if (ret < 0)
+			goto i2c_exit;
+	}
+
+	ret = num;
+i2c_exit:
+	if (ft260_i2c_fallback_update(dev, msgs[0].addr, ret) && !retried) {
+		retried = true;
+		goto retry;
+	}
+	dev->i2c_stats.xfers++;
+	dev->i2c_stats.msgs += num;
+	if (ret < 0)
+		dev->i2c_stats.errors++;
+	ft260_i2c_xfer_end(dev, msgs[0].addr, &mark, ret);
+	up_read(&dev->chip->traffic_lock);
+	hid_hw_power(hdev, PM_HINT_NORMAL);
+	mutex_unlock(&dev->lock);
+	return ret;
+}
+
+static int ft260_smbus_xfer(struct i2c_adapter *adapter, u16 addr, u16 flags,
+			    char read_write, u8 cmd, int size,
+			    union i2c_smbus_data *data)
+{
+	int ret;
+	struct ft260_device *dev = i2c_get_adapdata(adapter);
+	struct hid_device *hdev = dev->hdev;
+	struct ft260_i2c_xfer_mark mark;
+	bool retried = false;
+
+	ft260_dbg_i2c("smbus size %d\n", size);
+
+	mutex_lock(&dev->lock);
+
+	ret = hid_hw_power(hdev, PM_HINT_FULLON);
 	if (ret < 0) {
 		hid_err(hdev, "power management error: %d\n", ret);
 		mutex_unlock(&dev->lock);
 		return ret;
 	}
 
+	down_read(&dev->chip->traffic_lock);
+	ft260_i2c_xfer_begin(dev, &mark);
+retry:
+	dev->i2c_bus_status = 0;
+	ret = ft260_i2c_clock_select(dev, addr);
+	if (ret < 0)
+		goto smbus_exit;
+
 	switch (size) {
 	case I2C_SMBUS_BYTE:
 		if (read_write == I2C_SMBUS_READ)
@@ -956,6 +2600,16 @@ static int ft260_smbus_xfer(struct i2c_adapter *adapter, u16 addr, u16 flags,
 	}
 
 smbus_exit:
+	if (ft260_i2c_fallback_update(dev, addr, ret) && !retried) {
+		retried = true;
+		goto retry;
+	}
+	dev->i2c_stats.xfers++;
+	dev->i2c_stats.msgs++;
+	if (ret < 0)
+		dev->i2c_stats.errors++;
+	ft260_i2c_xfer_end(dev, addr, &mark, ret);
+	up_read(&dev->chip->traffic_lock);
 	hid_hw_power(hdev, PM_HINT_NORMAL);
 	mutex_unlock(&dev->lock);
 	return ret;
@@ -979,20 +2633,21 @@ static const struct i2c_algorithm ft260_i2c_algo = {
 	.functionality = ft260_functionality,
 };
 
-static void ft260_gpio_en_set(struct ft260_device *dev, u16 bitmap)
+static void ft260_gpio_en_set(struct ft260_chip *chip, u16 bitmap)
 {
-	dev->gpio_en |= bitmap & FT260_GPIO_MASK;
+	chip->gpio_en |= bitmap & FT260_GPIO_MASK;
 }
 
-static void ft260_gpio_en_clr(struct ft260_device *dev, u16 bitmap)
+static void ft260_gpio_en_clr(struct ft260_chip *chip, u16 bitmap)
 {
-	dev->gpio_en &= ~bitmap & FT260_GPIO_MASK;
+	chip->gpio_en &= ~bitmap & FT260_GPIO_MASK;
 }
 
 static void ft260_gpio_en_update(struct hid_device *hdev, u8 req, u8 value)
 {
 	u16 bitmap;
 	struct ft260_device *dev = hid_get_drvdata(hdev);
+	struct ft260_chip *chip = dev->chip;
 
 	switch (req) {
 
@@ -1017,9 +2672,10 @@ static void ft260_gpio_en_update(struct hid_device *hdev, u8 req, u8 value)
 		default:
 			return;
 		}
-		ft260_gpio_en_clr(dev, bitmap);
-		bitmap = dev->gpio_uart_mode[value];
-		ft260_gpio_en_set(dev, bitmap);
+		mutex_lock(&chip->gpio_lock);
+		ft260_gpio_en_clr(chip, bitmap);
+		bitmap = chip->gpio_uart_mode[value];
+		ft260_gpio_en_set(chip, bitmap);
 		goto exit;
 
 	case FT260_ENABLE_UART_DCD_RI:
@@ -1039,37 +2695,39 @@ static void ft260_gpio_en_update(struct hid_device *hdev, u8 req, u8 value)
 		return;
 	}
 
+	mutex_lock(&chip->gpio_lock);
 	if (value == FT260_MFPIN_GPIO)
-		ft260_gpio_en_set(dev, bitmap);
+		ft260_gpio_en_set(chip, bitmap);
 	else
-		ft260_gpio_en_clr(dev, bitmap);
+		ft260_gpio_en_clr(chip, bitmap);
 exit:
-	hid_info(hdev, "enabled GPIOs: %04x\n", dev->gpio_en);
+	hid_info(hdev, "enabled GPIOs: %04x\n", chip->gpio_en);
+	mutex_unlock(&chip->gpio_lock);
 }
 
 static void ft260_gpio_set(struct gpio_chip *gc, u32 offset, int value)
 {
 	int ret;
 	struct ft260_gpio_write_request_report rep;
-	struct ft260_device *dev = gpiochip_get_data(gc);
-	struct hid_device *hdev = dev->hdev;
+	struct ft260_chip *chip = gpiochip_get_data(gc);
+	struct hid_device *hdev = chip->gpio_hdev;
 
 	if (offset >= FT260_GPIO_TOTAL) {
 		hid_err(hdev, "%s: invalid offset %d\n", __func__, offset);
 		return;
 	}
 
-	ft260_dbg("offset %d val %d\n", offset, value);
+	ft260_dbg_gpio("offset %d val %d\n", offset, value);
 
-	mutex_lock(&dev->lock);
+	mutex_lock(&chip->gpio_lock);
 
-	if (!(dev->gpio_en & (1 << offset))) {
+	if (!(chip->gpio_en & (1 << offset))) {
 		hid_err(hdev, "%s: wrong pin function %d\n", __func__, offset);
 		goto exit;
 	}
 
 	rep.report = FT260_GPIO;
-	rep.gpio = dev->gpio;
+	rep.gpio = chip->gpio;
 
 	if (offset < FT260_GPIO_MAX) {
 		if (value)
@@ -1084,9 +2742,9 @@ static void ft260_gpio_set(struct gpio_chip *gc, u32 offset, int value)
 			rep.gpio.ex_vals &= ~(1 << offset);
 	}
 
-	ft260_dbg("dirs %#02x vals %#02x ex_dir %#02x ex_vals %#02x\n",
-		  rep.gpio.dirs, rep.gpio.vals,
-		  rep.gpio.ex_dirs, rep.gpio.ex_vals);
+	ft260_dbg_gpio("dirs %#02x vals %#02x ex_dir %#02x ex_vals %#02x\n",
+		       rep.gpio.dirs, rep.gpio.vals,
+		       rep.gpio.ex_dirs, rep.gpio.ex_vals);
 
 	ret = ft260_hid_feature_report_set(hdev, (u8 *)&rep, sizeof(rep));
 	if (unlikely(ret < 0)) {
@@ -1094,9 +2752,9 @@ static void ft260_gpio_set(struct gpio_chip *gc, u32 offset, int value)
 		goto exit;
 	}
 
-	dev->gpio = rep.gpio;
+	chip->gpio = rep.gpio;
 exit:
-	mutex_unlock(&dev->lock);
+	mutex_unlock(&chip->gpio_lock);
 }
 
 static int ft260_gpio_direction_set(struct gpio_chip *gc, u32 offset,
@@ -1105,46 +2763,132 @@ static int ft260_gpio_direction_set(struct gpio_chip *gc, u32 offset,
 	int ret;
 	struct ft260_gpio_read_request_report buf;
 	struct ft260_gpio_write_request_report *rep;
-	struct ft260_device *dev = gpiochip_get_data(gc);
-	struct hid_device *hdev = dev->hdev;
+	struct ft260_chip *chip = gpiochip_get_data(gc);
+	struct hid_device *hdev = chip->gpio_hdev;
 
 	if (offset >= FT260_GPIO_TOTAL) {
 		hid_err(hdev, "%s: invalid offset %d\n", __func__, offset);
 		return -EINVAL;
 	}
 
-	ft260_dbg("offset %d val %d direction %d\n", offset, value, direction);
+	ft260_dbg_gpio("offset %d val %d direction %d\n", offset, value, direction);
 
-	mutex_lock(&dev->lock);
+	mutex_lock(&chip->gpio_lock);
 
-	if (!(dev->gpio_en & (1 << offset))) {
+	if (!(chip->gpio_en & (1 << offset))) {
 		hid_err(hdev, "%s: wrong pin function %d\n", __func__, offset);
 		ret = -EIO;
 		goto exit;
 	}
 
-	ret = ft260_hid_feature_report_get(hdev, FT260_GPIO, (u8 *)&buf, sizeof(buf));
+	ret = ft260_hid_feature_report_get(hdev, FT260_GPIO, (u8 *)&buf, sizeof(buf));
+	if (unlikely(ret < 0)) {
+		hid_err(hdev, "%s: cannot get GPIO: %d\n", __func__, ret);
+		goto exit;
+	}
+
+	rep = (struct ft260_gpio_write_request_report *)&buf;
+
+	/*
+	 * The output value goes in the same report as the direction, so the
+	 * pin switches in one transfer without glitching to the stale value.
+	 */
+	if (direction == FT260_GPIO_DIR_OUTPUT)
+		if (offset < FT260_GPIO_MAX) {
+			rep->gpio.dirs |= 1 << offset;
+			if (value)
+				rep->gpio.vals |= 1 << offset;
+			else
+				rep->gpio.vals &= ~(1 << offset);
+		} else {
+			rep->gpio.ex_dirs |= 1 << (offset - FT260_GPIO_MAX);
+			if (value)
+				rep->gpio.ex_vals |= 1 << (offset - FT260_GPIO_MAX);
+			else
+				rep->gpio.ex_vals &= ~(1 << (offset - FT260_GPIO_MAX));
+		}
+	else
+		if (offset < FT260_GPIO_MAX)
+			rep->gpio.dirs &= ~(1 << offset);
+		else
+			rep->gpio.ex_dirs &= ~(1 << (offset - FT260_GPIO_MAX));
+
+	ft260_dbg_gpio("dirs %#02x val %#02x ex_dirs %#02x ex_vals %#02x\n",
+		       rep->gpio.dirs, rep->gpio.vals,
+		       rep->gpio.ex_dirs, rep->gpio.ex_vals);
+
+	ret = ft260_hid_feature_report_set(hdev, (u8 *)rep, sizeof(*rep));
+	if (unlikely(ret < 0)) {
+		hid_err(hdev, "%s: cannot set GPIO: %d\n", __func__, ret);
+		goto exit;
+	}
+
+	chip->gpio = rep->gpio;
+	mutex_unlock(&chip->gpio_lock);
+
+	return 0;
+exit:
+	mutex_unlock(&chip->gpio_lock);
+	return ret;
+}
+
+/*
+ * Read the GPIO[A-H] state on behalf of the UART modem control lines,
+ * which use these pins when they are not taken by the flow control.
+ */
+static int ft260_gpio_ex_get(struct hid_device *hdev, u8 *ex_vals)
+{
+	struct ft260_gpio_read_request_report rep;
+	int ret;
+
+	ret = ft260_hid_feature_report_get(hdev, FT260_GPIO, (u8 *)&rep,
+					   sizeof(rep));
+	if (unlikely(ret < 0)) {
+		hid_err(hdev, "%s: cannot get GPIO: %d\n", __func__, ret);
+		return ret;
+	}
+
+	*ex_vals = rep.gpio.ex_vals;
+	return 0;
+}
+
+/*
+ * Drive the GPIO[A-H] pins in mask, enabled as GPIOs and not requested
+ * through gpiolib, to the given values
+ */
+static int ft260_gpio_ex_set(struct hid_device *hdev, u8 mask, u8 vals)
+{
+	struct ft260_device *dev = hid_get_drvdata(hdev);
+	struct ft260_chip *chip = dev->chip;
+	struct ft260_gpio_read_request_report buf;
+	struct ft260_gpio_write_request_report *rep;
+	int ret = 0;
+	int i;
+
+	mutex_lock(&chip->gpio_lock);
+
+	mask &= chip->gpio_en >> FT260_GPIO_MAX;
+	for (i = 0; chip->gc && i < FT260_GPIO_EX_MAX; i++) {
+		if ((mask & BIT(i)) &&
+		    gpiochip_is_requested(chip->gc, FT260_GPIO_MAX + i))
+			mask &= ~BIT(i);
+	}
+	if (!mask)
+		goto exit;
+
+	ret = ft260_hid_feature_report_get(hdev, FT260_GPIO, (u8 *)&buf,
+					   sizeof(buf));
 	if (unlikely(ret < 0)) {
 		hid_err(hdev, "%s: cannot get GPIO: %d\n", __func__, ret);
 		goto exit;
 	}
 
 	rep = (struct ft260_gpio_write_request_report *)&buf;
+	rep->gpio.ex_dirs |= mask;
+	rep->gpio.ex_vals = (rep->gpio.ex_vals & ~mask) | (vals & mask);
 
-	if (direction == FT260_GPIO_DIR_OUTPUT)
-		if (offset < FT260_GPIO_MAX)
-			rep->gpio.dirs |= 1 << offset;
-		else
-			rep->gpio.ex_dirs |= 1 << (offset - FT260_GPIO_MAX);
-	else
-		if (offset < FT260_GPIO_MAX)
-			rep->gpio.dirs &= ~(1 << offset);
-		else
-			rep->gpio.ex_dirs &= ~(1 << (offset - FT260_GPIO_MAX));
-
-	ft260_dbg("dirs %#02x val %#02x ex_dirs %#02x ex_vals %#02x\n",
-		  rep->gpio.dirs, rep->gpio.vals,
-		  rep->gpio.ex_dirs, rep->gpio.ex_vals);
+	ft260_dbg_gpio("ex_dirs %#02x ex_vals %#02x\n",
+		       rep->gpio.ex_dirs, rep->gpio.ex_vals);
 
 	ret = ft260_hid_feature_report_set(hdev, (u8 *)rep, sizeof(*rep));
 	if (unlikely(ret < 0)) {
@@ -1152,15 +2896,10 @@ static int ft260_gpio_direction_set(struct gpio_chip *gc, u32 offset,
 		goto exit;
 	}
 
-	dev->gpio = rep->gpio;
-	mutex_unlock(&dev->lock);
-
-	if (direction == FT260_GPIO_DIR_OUTPUT)
-		ft260_gpio_set(gc, offset, value);
-
-	return 0;
+	chip->gpio = rep->gpio;
+	ret = 0;
 exit:
-	mutex_unlock(&dev->lock);
+	mutex_unlock(&chip->gpio_lock);
 	return ret;
 }
 
@@ -1181,8 +2920,8 @@ static int ft260_gpio_get_all(struct gpio_chip *gc, int item)
 {
 	int ret;
 	struct ft260_gpio_read_request_report rep;
-	struct ft260_device *dev = gpiochip_get_data(gc);
-	struct hid_device *hdev = dev->hdev;
+	struct ft260_chip *chip = gpiochip_get_data(gc);
+	struct hid_device *hdev = chip->gpio_hdev;
 
 	ret = ft260_hid_feature_report_get(hdev, FT260_GPIO, (u8 *)&rep, sizeof(rep));
 	if (unlikely(ret < 0)) {
@@ -1224,40 +2963,46 @@ static int ft260_gpio_init(struct ft260_device *dev,
 	char * label;
 	struct ft260_get_chip_version_report ver;
 	struct hid_device *hdev = dev->hdev;
+	struct ft260_chip *chip = dev->chip;
 	char prefix[] = "ft260_";
 
-	hid_info(hdev, "initialize gpio chip\n");
+	/* The gpio chip is registered once per chip by the first interface */
+	mutex_lock(&chip->gpio_lock);
+	if (chip->gpio_hdev) {
+		mutex_unlock(&chip->gpio_lock);
+		return 0;
+	}
+	chip->gpio_hdev = hdev;
 
-	dev->gpio_uart_mode[0] = (u16)FT260_GPIO_UART_MODE_0_SET;
-	dev->gpio_uart_mode[1] = (u16)FT260_GPIO_UART_MODE_1_SET;
-	dev->gpio_uart_mode[2] = (u16)FT260_GPIO_UART_MODE_2_SET;
-	dev->gpio_uart_mode[3] = (u16)FT260_GPIO_UART_MODE_3_SET;
-	dev->gpio_uart_mode[4] = (u16)FT260_GPIO_UART_MODE_4_SET;
+	hid_info(hdev, "initialize gpio chip\n");
 
 	if (cfg->chip_mode) {
 		if (cfg->chip_mode & FT260_MODE_UART || cfg->chip_mode == FT260_MODE_ALL)
-			dev->gpio_en |= dev->gpio_uart_mode[cfg->uart_mode];
+			chip->gpio_en |= chip->gpio_uart_mode[cfg->uart_mode];
 		else
-			dev->gpio_en |= FT260_GPIO_UART_DEFAULT;
+			chip->gpio_en |= FT260_GPIO_UART_DEFAULT;
 
 		if (!(cfg->chip_mode & FT260_MODE_I2C))
-			dev->gpio_en |= FT260_GPIO_I2C_DEFAULT;
+			chip->gpio_en |= FT260_GPIO_I2C_DEFAULT;
 	}
 
 	if (cfg->gpio2_func == FT260_MFPIN_GPIO)
-		dev->gpio_en |= FT260_GPIO_2;
+		chip->gpio_en |= FT260_GPIO_2;
 	if (cfg->enable_wakeup_int == FT260_MFPIN_GPIO)
-		dev->gpio_en |= FT260_GPIO_3;
+		chip->gpio_en |= FT260_GPIO_3;
 	if (cfg->gpioa_func == FT260_MFPIN_GPIO)
-		dev->gpio_en |= FT260_GPIO_A;
+		chip->gpio_en |= FT260_GPIO_A;
 	if (cfg->gpiog_func == FT260_MFPIN_GPIO)
-		dev->gpio_en |= FT260_GPIO_G;
+		chip->gpio_en |= FT260_GPIO_G;
 
-	hid_info(hdev, "enabled GPIOs: %04x\n", dev->gpio_en);
+	hid_info(hdev, "enabled GPIOs: %04x\n", chip->gpio_en);
+	mutex_unlock(&chip->gpio_lock);
 
-	dev->gc = devm_kzalloc(&hdev->dev, sizeof(*dev->gc), GFP_KERNEL);
-	if (!dev->gc)
-		return -ENOMEM;
+	chip->gc = devm_kzalloc(&hdev->dev, sizeof(*chip->gc), GFP_KERNEL);
+	if (!chip->gc) {
+		ret = -ENOMEM;
+		goto exit;
+	}
 
 	label_sz = strlen(dev_name(&hdev->dev)) + strlen(prefix) + 1;
 	label = devm_kzalloc(&hdev->dev, label_sz, GFP_KERNEL);
@@ -1268,28 +3013,53 @@ static int ft260_gpio_init(struct ft260_device *dev,
 	snprintf(label, label_sz, "%s%s", prefix, dev_name(&hdev->dev));
 	hid_info(hdev, "initialize gpio chip on %s\n", label);
 
-	dev->gc->label			= label;
-	dev->gc->direction_input	= ft260_gpio_direction_input;
-	dev->gc->direction_output	= ft260_gpio_direction_output;
-	dev->gc->get_direction		= ft260_gpio_get_direction;
-	dev->gc->set			= ft260_gpio_set;
-	dev->gc->get			= ft260_gpio_get;
-	dev->gc->base			= -1;
-	dev->gc->ngpio			= FT260_GPIO_TOTAL;
-	dev->gc->can_sleep		= true;
-	dev->gc->parent			= &hdev->dev;
+	chip->gc->label			= label;
+	chip->gc->direction_input	= ft260_gpio_direction_input;
+	chip->gc->direction_output	= ft260_gpio_direction_output;
+	chip->gc->get_direction		= ft260_gpio_get_direction;
+	chip->gc->set			= ft260_gpio_set;
+	chip->gc->get			= ft260_gpio_get;
+	chip->gc->base			= -1;
+	chip->gc->ngpio			= FT260_GPIO_TOTAL;
+	chip->gc->can_sleep		= true;
+	chip->gc->parent		= &hdev->dev;
 
 	/* Wakeup chip */
 	(void)ft260_hid_feature_report_get(dev->hdev, FT260_CHIP_VERSION,
 					(u8 *)&ver, sizeof(ver));
 
-	ret = devm_gpiochip_add_data(&hdev->dev, dev->gc, dev);
-	if (ret < 0)
+	/*
+	 * The gpio chip data is the shared chip object, which may be released
+	 * before the devres of this interface, so it is removed explicitly.
+	 */
+	ret = gpiochip_add_data(chip->gc, chip);
+	if (ret < 0) {
 		hid_err(hdev, "cannot add GPIO chip %d\n", ret);
+		goto exit;
+	}
+	return 0;
 exit:
+	chip->gc = NULL;
+	chip->gpio_hdev = NULL;
 	return ret;
 }
 
+static void ft260_gpio_remove(struct ft260_device *dev)
+{
+	struct ft260_chip *chip = dev->chip;
+
+	if (chip->gpio_hdev != dev->hdev)
+		return;
+
+	if (chip->gc)
+		gpiochip_remove(chip->gc);
+
+	mutex_lock(&chip->gpio_lock);
+	chip->gc = NULL;
+	chip->gpio_hdev = NULL;
+	mutex_unlock(&chip->gpio_lock);
+}
+
 static int ft260_get_system_config(struct hid_device *hdev,
 				   struct ft260_get_system_status_report *cfg)
 {
@@ -1305,29 +3075,117 @@ static int ft260_get_system_config(struct hid_device *hdev,
 	return 0;
 }
 
+static DEFINE_MUTEX(ft260_chip_list_lock);
+static LIST_HEAD(ft260_chip_list);
+
+/*
+ * Attach the interface to the chip object of its parent USB device,
+ * creating it and reading the chip configuration on the first interface.
+ */
+static int ft260_chip_get(struct ft260_device *dev)
+{
+	struct hid_device *hdev = dev->hdev;
+	struct usb_interface *usbif = to_usb_interface(hdev->dev.parent);
+	struct usb_device *udev = interface_to_usbdev(usbif);
+	struct ft260_get_chip_version_report version;
+	struct ft260_chip *chip;
+	int ret = 0;
+
+	mutex_lock(&ft260_chip_list_lock);
+
+	list_for_each_entry(chip, &ft260_chip_list, list) {
+		if (chip->udev == udev) {
+			kref_get(&chip->kref);
+			dev->chip = chip;
+			goto exit;
+		}
+	}
+
+	chip = kzalloc(sizeof(*chip), GFP_KERNEL);
+	if (!chip) {
+		ret = -ENOMEM;
+		goto exit;
+	}
+
+	kref_init(&chip->kref);
+	chip->udev = usb_get_dev(udev);
+	mutex_init(&chip->ctrl_lock);
+	mutex_init(&chip->gpio_lock);
+	mutex_init(&chip->clock_lock);
+	init_rwsem(&chip->traffic_lock);
+	chip->clock_auto = clock_ctl_auto;
+	chip->last_activity = jiffies;
+
+	chip->gpio_uart_mode[0] = (u16)FT260_GPIO_UART_MODE_0_SET;
+	chip->gpio_uart_mode[1] = (u16)FT260_GPIO_UART_MODE_1_SET;
+	chip->gpio_uart_mode[2] = (u16)FT260_GPIO_UART_MODE_2_SET;
+	chip->gpio_uart_mode[3] = (u16)FT260_GPIO_UART_MODE_3_SET;
+	chip->gpio_uart_mode[4] = (u16)FT260_GPIO_UART_MODE_4_SET;
+
+	dev->chip = chip;
+
+	ret = ft260_hid_feature_report_get(hdev, FT260_CHIP_VERSION,
+					   (u8 *)&version, sizeof(version));
+	if (ret < 0) {
+		hid_err(hdev, "failed to retrieve chip version\n");
+		goto err_free;
+	}
+
+	hid_info(hdev, "chip code: %02x%02x %02x%02x\n",
+		 version.chip_code[0], version.chip_code[1],
+		 version.chip_code[2], version.chip_code[3]);
+
+	ret = ft260_get_system_config(hdev, &chip->cfg);
+	if (ret < 0)
+		goto err_free;
+
+	list_add(&chip->list, &ft260_chip_list);
+	goto exit;
+
+err_free:
+	dev->chip = NULL;
+	usb_put_dev(chip->udev);
+	kfree(chip);
+exit:
+	mutex_unlock(&ft260_chip_list_lock);
+	return ret;
+}
+
+static void ft260_chip_release(struct kref *kref)
+{
+	struct ft260_chip *chip = container_of(kref, struct ft260_chip, kref);
+
+	list_del(&chip->list);
+	mutex_unlock(&ft260_chip_list_lock);
+
+	usb_put_dev(chip->udev);
+	kfree(chip);
+}
+
+static void ft260_chip_put(struct ft260_chip *chip)
+{
+	kref_put_mutex(&chip->kref, ft260_chip_release, &ft260_chip_list_lock);
+}
+
 static int ft260_get_interface_type(struct ft260_device *dev,
 				    struct ft260_get_system_status_report *cfg)
 
 {
-	int ret;
+	int ret = FT260_IFACE_NONE;
 	struct hid_device *hdev = dev->hdev;
 	struct usb_interface *usbif = to_usb_interface(hdev->dev.parent);
 
 	dev->iface_id = usbif->cur_altsetting->desc.bInterfaceNumber;
 
-	ret = ft260_get_system_config(hdev, cfg);
-	if (ret < 0)
-		return ret;
-
-	ft260_dbg("interface:  0x%02x\n", dev->iface_id);
-	ft260_dbg("chip mode:  0x%02x\n", cfg->chip_mode);
-	ft260_dbg("clock_ctl:  0x%02x\n", cfg->clock_ctl);
-	ft260_dbg("i2c_enable: 0x%02x\n", cfg->i2c_enable);
-	ft260_dbg("uart_mode:  0x%02x\n", cfg->uart_mode);
-	ft260_dbg("gpio2_func: 0x%02x\n", cfg->gpio2_func);
-	ft260_dbg("gpioA_func: 0x%02x\n", cfg->gpioa_func);
-	ft260_dbg("gpioG_func: 0x%02x\n", cfg->gpiog_func);
-	ft260_dbg("wakeup_int: 0x%02x\n", cfg->enable_wakeup_int);
+	ft260_dbg_config("interface:  0x%02x\n", dev->iface_id);
+	ft260_dbg_config("chip mode:  0x%02x\n", cfg->chip_mode);
+	ft260_dbg_config("clock_ctl:  0x%02x\n", cfg->clock_ctl);
+	ft260_dbg_config("i2c_enable: 0x%02x\n", cfg->i2c_enable);
+	ft260_dbg_config("uart_mode:  0x%02x\n", cfg->uart_mode);
+	ft260_dbg_config("gpio2_func: 0x%02x\n", cfg->gpio2_func);
+	ft260_dbg_config("gpioA_func: 0x%02x\n", cfg->gpioa_func);
+	ft260_dbg_config("gpioG_func: 0x%02x\n", cfg->gpiog_func);
+	ft260_dbg_config("wakeup_int: 0x%02x\n", cfg->enable_wakeup_int);
 
 	dev->power_saving_en = cfg->power_saving_en;
 
@@ -1375,8 +3233,15 @@ static int ft260_word_show(struct hid_device *hdev, int id, u8 *cfg, int len,
 	return scnprintf(buf, PAGE_SIZE, "%d\n", le16_to_cpu(*field));
 }
 
-static void ft260_attr_dummy_func(struct hid_device *hdev, u8 req, u16 value)
+/* A system clock set by hand stops the automatic choice */
+static void ft260_clock_ctl_update(struct hid_device *hdev, u8 req, u16 value)
 {
+	struct ft260_device *dev = hid_get_drvdata(hdev);
+
+	mutex_lock(&dev->chip->clock_lock);
+	dev->chip->clock_auto = false;
+	dev->chip->cfg.clock_ctl = value;
+	mutex_unlock(&dev->chip->clock_lock);
 }
 
 #define FT260_ATTR_SHOW(name, reptype, id, type, func)			       \
@@ -1482,14 +3347,236 @@ static DEVICE_ATTR_WO(uart_dcd_ri);
 
 FT260_SSTAT_ATTR_SHOW(clock_ctl);
 FT260_BYTE_ATTR_STORE(clock_ctl, ft260_set_system_clock_report,
-		      FT260_SET_CLOCK, ft260_attr_dummy_func);
+		      FT260_SET_CLOCK, ft260_clock_ctl_update);
 static DEVICE_ATTR_RW(clock_ctl);
 
+/* Fastest I2C clock and UART baud rate of each clock_ctl setting */
+static const struct {
+	u16 i2c_khz;
+	u32 uart_baud;
+} ft260_sysclk_caps[] = {
+	{ 400, 3000000 },	/* 12MHz */
+	{ 1000, 6000000 },	/* 24MHz */
+	{ 3400, 12000000 },	/* 48MHz */
+};
+
+static int ft260_uart_config_restore(struct ft260_device *port);
+
+/*
+ * Select the lowest system clock serving both the I2C clock and the UART
+ * baud rate, unless the user has set clock_ctl by hand. The I2C transfers
+ * and the UART transmission of both interfaces are held off while the clock
+ * changes, and the UART divisors are programmed again for the new clock.
+ */
+static int ft260_sysclk_update(struct ft260_device *dev)
+{
+	struct ft260_chip *chip = dev->chip;
+	struct ft260_set_system_clock_report rep;
+	struct ft260_device *port = chip->uart_port;
+	int i, ret;
+
+	lockdep_assert_held(&chip->clock_lock);
+
+	if (!chip->clock_auto)
+		return 0;
+
+	for (i = 0; i < ARRAY_SIZE(ft260_sysclk_caps) - 1; i++)
+		if (ft260_sysclk_caps[i].i2c_khz >= chip->i2c_khz &&
+		    ft260_sysclk_caps[i].uart_baud >= chip->uart_baud)
+			break;
+
+	if (i == chip->cfg.clock_ctl)
+		return 0;
+
+	rep.report = FT260_SYSTEM_SETTINGS;
+	rep.request = FT260_SET_CLOCK;
+	rep.clock_ctl = i;
+
+	down_write(&chip->traffic_lock);
+
+	ret = ft260_hid_feature_report_set(dev->hdev, (u8 *)&rep, sizeof(rep));
+	if (ret < 0) {
+		hid_err(dev->hdev, "failed to set system clock: %d\n", ret);
+		goto exit;
+	}
+
+	ft260_dbg_config("system clock %uMHz for i2c %u KHz, uart %u baud\n",
+			 12 << i, chip->i2c_khz, chip->uart_baud);
+	chip->cfg.clock_ctl = i;
+
+	if (port && chip->uart_baud) {
+		/* The callers never hold the port lock, see clock_store() */
+		lockdep_assert_not_held(&port->lock);
+		mutex_lock(&port->lock);
+		ret = ft260_uart_config_restore(port);
+		mutex_unlock(&port->lock);
+		if (ret < 0)
+			hid_err(port->hdev, "failed to restore uart config: %d\n",
+				ret);
+	}
+exit:
+	up_write(&chip->traffic_lock);
+	return ret < 0 ? ret : 0;
+}
+
+static int ft260_sysclk_set_i2c(struct ft260_device *dev, u16 khz)
+{
+	int ret;
+
+	mutex_lock(&dev->chip->clock_lock);
+	dev->chip->i2c_khz = khz;
+	ret = ft260_sysclk_update(dev);
+	mutex_unlock(&dev->chip->clock_lock);
+
+	return ret;
+}
+
+static int ft260_sysclk_set_uart(struct ft260_device *dev, u32 baud)
+{
+	int ret;
+
+	mutex_lock(&dev->chip->clock_lock);
+	dev->chip->uart_baud = baud;
+	ret = ft260_sysclk_update(dev);
+	mutex_unlock(&dev->chip->clock_lock);
+
+	return ret;
+}
+
+/* The fastest of the default and the per-target I2C clocks */
+static u16 ft260_i2c_clock_max(struct ft260_device *dev, u16 clock)
+{
+	int addr;
+
+	for (addr = 0; addr < FT260_I2C_TARGETS; addr++)
+		clock = max(clock, dev->i2c_target_clock[addr]);
+
+	return clock;
+}
+
 FT260_I2CST_ATTR_SHOW(clock);
-FT260_WORD_ATTR_STORE(clock, ft260_set_i2c_speed_report,
-		      FT260_SET_I2C_CLOCK_SPEED, ft260_attr_dummy_func);
+
+/*
+ * The clock written by the user is the default of the per-target clocks.
+ * The system clock is raised beforehand if the new clock needs it.
+ */
+static ssize_t clock_store(struct device *kdev, struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+	struct ft260_set_i2c_speed_report rep;
+	struct hid_device *hdev = to_hid_device(kdev);
+	struct ft260_device *dev = hid_get_drvdata(hdev);
+	u16 clock;
+	int ret;
+
+	/* On a UART interface, dev->lock is the port lock */
+	if (dev->iface_type != FT260_IFACE_I2C)
+		return -EOPNOTSUPP;
+
+	if (kstrtou16(buf, 10, &clock) || clock < 60 || clock > 3400)
+		return -EINVAL;
+
+	mutex_lock(&dev->lock);
+	ret = ft260_sysclk_set_i2c(dev, ft260_i2c_clock_max(dev, clock));
+	if (ret < 0)
+		goto exit;
+
+	rep.report = FT260_SYSTEM_SETTINGS;
+	rep.request = FT260_SET_I2C_CLOCK_SPEED;
+	rep.clock = cpu_to_le16(clock);
+
+	ret = ft260_hid_feature_report_set(hdev, (u8 *)&rep, sizeof(rep));
+	if (ret < 0) {
+		hid_err(hdev, "%s: failed!\n", __func__);
+		goto exit;
+	}
+
+	dev->clock = clock;
+	dev->i2c_clock_set = clock;
+	dev->i2c_clock_default = clock;
+exit:
+	mutex_unlock(&dev->lock);
+	return ret < 0 ? ret : count;
+}
 static DEVICE_ATTR_RW(clock);
 
+static ssize_t target_clock_show(struct device *kdev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct ft260_device *dev = hid_get_drvdata(to_hid_device(kdev));
+	int addr, len = 0;
+
+	if (dev->iface_type != FT260_IFACE_I2C)
+		return -EOPNOTSUPP;
+
+	mutex_lock(&dev->lock);
+	for (addr = 0; addr < FT260_I2C_TARGETS; addr++) {
+		if (dev->i2c_target_clock[addr])
+			len += sysfs_emit_at(buf, len, "%#04x %u\n", addr,
+					     dev->i2c_target_clock[addr]);
+	}
+	mutex_unlock(&dev->lock);
+
+	return len;
+}
+
+/* "<addr> <KHz>" sets the clock of the target, KHz 0 removes it */
+static ssize_t target_clock_store(struct device *kdev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct ft260_device *dev = hid_get_drvdata(to_hid_device(kdev));
+	unsigned int addr, clock;
+	int ret;
+
+	if (dev->iface_type != FT260_IFACE_I2C)
+		return -EOPNOTSUPP;
+
+	if (sscanf(buf, "%i %u", &addr, &clock) != 2 ||
+	    addr >= FT260_I2C_TARGETS ||
+	    (clock && (clock < 60 || clock > 3400)))
+		return -EINVAL;
+
+	mutex_lock(&dev->lock);
+	dev->i2c_target_clock[addr] = clock;
+	ret = ft260_sysclk_set_i2c(dev, ft260_i2c_clock_max(dev,
+						dev->i2c_clock_default));
+	mutex_unlock(&dev->lock);
+
+	return ret < 0 ? ret : count;
+}
+static DEVICE_ATTR_RW(target_clock);
+
+static ssize_t clock_ctl_auto_show(struct device *kdev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct ft260_device *dev = hid_get_drvdata(to_hid_device(kdev));
+
+	return sysfs_emit(buf, "%d\n", dev->chip->clock_auto);
+}
+
+/* Writing 1 resumes the automatic choice after a manual clock_ctl write */
+static ssize_t clock_ctl_auto_store(struct device *kdev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct ft260_device *dev = hid_get_drvdata(to_hid_device(kdev));
+	bool enable;
+	int ret;
+
+	ret = kstrtobool(buf, &enable);
+	if (ret)
+		return ret;
+
+	mutex_lock(&dev->chip->clock_lock);
+	dev->chip->clock_auto = enable;
+	ret = ft260_sysclk_update(dev);
+	mutex_unlock(&dev->chip->clock_lock);
+
+	return ret < 0 ? ret : count;
+}
+static DEVICE_ATTR_RW(clock_ctl_auto);
+
 static ssize_t i2c_reset_store(struct device *kdev,
 			       struct device_attribute *attr, const char *buf,
 			       size_t count)
@@ -1519,6 +3606,8 @@ static const struct attribute_group ft260_attr_group = {
 		  &dev_attr_clock_ctl.attr,
 		  &dev_attr_i2c_reset.attr,
 		  &dev_attr_clock.attr,
+		  &dev_attr_target_clock.attr,
+		  &dev_attr_clock_ctl_auto.attr,
 		  NULL
 	}
 };
@@ -1528,49 +3617,145 @@ static LIST_HEAD(ft260_uart_device_list);
 
 static void ft260_uart_wakeup(struct ft260_device *dev);
 
-static int ft260_get_uart_settings(struct hid_device *hdev,
-				   struct ft260_get_uart_settings_report *cfg)
+static int ft260_get_uart_settings(struct hid_device *hdev,
+				   struct ft260_get_uart_settings_report *cfg)
+{
+	int ret;
+	int len = sizeof(struct ft260_get_uart_settings_report);
+
+	ret = ft260_hid_feature_report_get(hdev, FT260_UART_SETTINGS,
+					   (u8 *)cfg, len);
+	if (ret < 0) {
+		hid_err(hdev, "failed to retrieve uart settings\n");
+		return ret;
+	}
+	return 0;
+}
+
+static void ft260_uart_wakeup_workaraund_enable(struct ft260_device *port,
+						bool enable)
+{
+	if (port->power_saving_en) {
+		port->reschedule_work = enable;
+		ft260_dbg_uart("%s wakeup workaround",
+			       enable ? "activate" : "deactivate");
+	}
+}
+
+static struct ft260_device *ft260_dev_by_index(int index)
+{
+	struct ft260_device *port;
+
+	list_for_each_entry(port, &ft260_uart_device_list, device_list) {
+		if (index == port->index)
+			return port;
+	}
+	return NULL;
+}
+
+static unsigned int ft260_xmit_len(struct ft260_xmit_ring *ring)
+{
+	return smp_load_acquire(&ring->head) - READ_ONCE(ring->tail);
+}
+
+static unsigned int ft260_xmit_avail(struct ft260_xmit_ring *ring)
+{
+	return ring->size - ft260_xmit_len(ring);
+}
+
+/* Producer side, returns the number of bytes queued */
+static unsigned int ft260_xmit_put(struct ft260_xmit_ring *ring,
+				   const u8 *data, unsigned int cnt)
+{
+	unsigned int head = ring->head;
+	/* Pairs with the release in ft260_xmit_consume() */
+	unsigned int tail = smp_load_acquire(&ring->tail);
+	unsigned int off = head & (ring->size - 1);
+	unsigned int len;
+
+	cnt = min(cnt, ring->size - (head - tail));
+	len = min(cnt, ring->size - off);
+
+	memcpy(ring->buf + off, data, len);
+	memcpy(ring->buf, data + len, cnt - len);
+
+	/* Publish the data before the new head */
+	smp_store_release(&ring->head, head + cnt);
+
+	return cnt;
+}
+
+/*
+ * Consumer side, returns the length of the contiguous region of queued data
+ * starting at the tail, up to the ring end.
+ */
+static unsigned int ft260_xmit_peek(struct ft260_xmit_ring *ring, u8 **data)
+{
+	unsigned int tail = ring->tail;
+	/* Pairs with the release in ft260_xmit_put() */
+	unsigned int head = smp_load_acquire(&ring->head);
+	unsigned int off = tail & (ring->size - 1);
+
+	*data = ring->buf + off;
+
+	return min(head - tail, ring->size - off);
+}
+
+/* Consumer side, releases the space of the len bytes already sent */
+static void ft260_xmit_consume(struct ft260_xmit_ring *ring, unsigned int len)
 {
-	int ret;
-	int len = sizeof(struct ft260_get_uart_settings_report);
-
-	ret = ft260_hid_feature_report_get(hdev, FT260_UART_SETTINGS,
-					   (u8 *)cfg, len);
-	if (ret < 0) {
-		hid_err(hdev, "failed to retrieve uart settings\n");
-		return ret;
-	}
-	return 0;
+	smp_store_release(&ring->tail, ring->tail + len);
 }
 
-static void ft260_uart_wakeup_workaraund_enable(struct ft260_device *port,
-						bool enable)
+/* Discard the data queued before head. Called with tx_lock held. */
+static void ft260_xmit_discard_to(struct ft260_device *port,
+				  unsigned int head)
 {
-	if (port->power_saving_en) {
-		port->reschedule_work = enable;
-		ft260_dbg("%s wakeup workaround",
-			  enable ? "activate" : "deactivate");
-	}
+	/* Never move the tail back behind the data already sent */
+	if ((int)(head - port->xmit.tail) > 0)
+		smp_store_release(&port->xmit.tail, head);
 }
 
-static struct ft260_device *ft260_dev_by_index(int index)
+/* Called with tx_lock held */
+static void ft260_xmit_discard(struct ft260_device *port)
 {
-	struct ft260_device *port;
+	xchg(&port->xmit_flush, false);
+	ft260_xmit_discard_to(port, smp_load_acquire(&port->xmit.head));
+}
 
-	list_for_each_entry(port, &ft260_uart_device_list, device_list) {
-		if (index == port->index)
-			return port;
-	}
-	return NULL;
+/*
+ * Handle a discard requested while the transmitter was running, dropping
+ * only the data queued before the request. Called with tx_lock held.
+ */
+static void ft260_xmit_flush_pending(struct ft260_device *port)
+{
+	/* Pairs with the release in ft260_uart_flush_buffer() */
+	if (xchg(&port->xmit_flush, false))
+		ft260_xmit_discard_to(port, READ_ONCE(port->xmit_flush_head));
 }
 
 static int ft260_uart_add_port(struct ft260_device *port)
 {
-	int index = 0, ret = 0;
+	int index = 0;
 	struct ft260_device *dev;
 
-	spin_lock_init(&port->xmit_fifo_lock);
-	if (kfifo_alloc(&port->xmit_fifo, XMIT_FIFO_SIZE, GFP_KERNEL))
+	/* Freed by the port destructor */
+	port->rx_frame = kmalloc(FT260_UART_FRAME_MAX, GFP_KERNEL);
+	port->uart_wr_buf = kmalloc(FT260_REPORT_MAX_LEN, GFP_KERNEL);
+	port->rx_ts = kcalloc(FT260_UART_RX_TS_RING, sizeof(*port->rx_ts),
+			      GFP_KERNEL);
+	if (!port->rx_frame || !port->uart_wr_buf || !port->rx_ts)
+		return -ENOMEM;
+
+	port->xmit.size = roundup_pow_of_two(clamp_t(unsigned int,
+						     xmit_fifo_size, PAGE_SIZE,
+						     FT260_XMIT_FIFO_MAX));
+	port->xmit.buf = kvmalloc(port->xmit.size, GFP_KERNEL);
+	if (!port->xmit.buf)
+		return -ENOMEM;
+
+	if (rx_ring_size &&
+	    kfifo_alloc(&port->rx_ring, rx_ring_size, GFP_KERNEL))
 		return -ENOMEM;
 
 	mutex_lock(&ft260_uart_list_lock);
@@ -1584,7 +3769,44 @@ static int ft260_uart_add_port(struct ft260_device *port)
 	list_add(&port->device_list, &ft260_uart_device_list);
 	mutex_unlock(&ft260_uart_list_lock);
 
-	return ret;
+	return 0;
+}
+
+static void ft260_uart_tx_work(struct kthread_work *work);
+
+/*
+ * The SCHED_FIFO transmit worker only exists in the low latency mode. The
+ * work queued to a worker is completed before the worker is destroyed.
+ * Called with port->port.mutex held.
+ */
+static int ft260_uart_low_latency_set(struct ft260_device *port, bool enable)
+{
+	struct kthread_worker *worker = NULL;
+
+	lockdep_assert_held(&port->port.mutex);
+
+	if (enable == !!port->tx_worker)
+		goto exit;
+
+	if (enable) {
+		worker = kthread_create_worker(0, "ft260_tx/%d", port->index);
+		if (IS_ERR(worker))
+			return PTR_ERR(worker);
+		sched_set_fifo(worker->task);
+		/* The work may not move to a new worker without a reinit */
+		kthread_init_work(&port->tx_work, ft260_uart_tx_work);
+	}
+
+	spin_lock(&port->tx_worker_lock);
+	swap(port->tx_worker, worker);
+	spin_unlock(&port->tx_worker_lock);
+
+	if (worker)
+		kthread_destroy_worker(worker);
+exit:
+	WRITE_ONCE(port->low_latency, enable);
+	ft260_dbg_config("low latency %s", enable ? "on" : "off");
+	return 0;
 }
 
 static void ft260_uart_port_put(struct ft260_device *port)
@@ -1595,19 +3817,23 @@ static void ft260_uart_port_put(struct ft260_device *port)
 static void ft260_uart_port_remove(struct ft260_device *port)
 {
 	timer_delete_sync(&port->wakeup_timer);
+	hrtimer_cancel(&port->rx_push_timer);
 
 	mutex_lock(&ft260_uart_list_lock);
 	list_del(&port->device_list);
 	mutex_unlock(&ft260_uart_list_lock);
 
-	spin_lock(&port->xmit_fifo_lock);
-	kfifo_free(&port->xmit_fifo);
-	spin_unlock(&port->xmit_fifo_lock);
-
 	mutex_lock(&port->port.mutex);
 	tty_port_tty_hangup(&port->port, false);
+	/* No writer is left after the hangup, let the worker drain */
+	ft260_uart_low_latency_set(port, false);
 	mutex_unlock(&port->port.mutex);
 
+	spin_lock_irq(&port->rx_lock);
+	if (kfifo_initialized(&port->rx_ring))
+		kfifo_free(&port->rx_ring);
+	spin_unlock_irq(&port->rx_lock);
+
 	ft260_uart_port_put(port);
 }
 
@@ -1627,123 +3853,721 @@ static struct ft260_device *ft260_uart_port_get(int index)
 	return port;
 }
 
-static int ft260_uart_open(struct tty_struct *tty, struct file *filp)
+static int ft260_uart_open(struct tty_struct *tty, struct file *filp)
+{
+	int ret;
+	struct ft260_device *port = tty->driver_data;
+
+	ret = tty_port_open(&port->port, tty, filp);
+
+	return ret;
+}
+
+static void ft260_uart_close(struct tty_struct *tty, struct file *filp)
+{
+	struct ft260_device *port = tty->driver_data;
+
+	tty_port_close(&port->port, tty, filp);
+}
+
+static void ft260_uart_hangup(struct tty_struct *tty)
+{
+	struct ft260_device *port = tty->driver_data;
+
+	tty_port_hangup(&port->port);
+}
+
+/* Time on the wire of one character with the programmed configuration */
+static u64 ft260_uart_char_time_ns(struct ft260_device *port)
+{
+	struct ft260_configure_uart_request_report *cfg = &port->uart_cfg;
+	unsigned int baud = get_unaligned_le32(&cfg->baudrate);
+	unsigned int bits;
+
+	if (!port->uart_cfg_valid || !baud)
+		return 0;
+
+	/* start bit + data bits + parity + stop bits */
+	bits = 1 + cfg->data_bit;
+	if (cfg->parity != FT260_UART_CFG_PAR_NO)
+		bits++;
+	bits += cfg->stop_bit == FT260_UART_CFG_STOP_TWO_BIT ? 2 : 1;
+
+	return div_u64((u64)bits * NSEC_PER_SEC, baud);
+}
+
+/* Account the bytes handed to the chip in the transmission end estimate */
+static void ft260_uart_tx_done_update(struct ft260_device *port, int len)
+{
+	ktime_t now = ktime_get();
+	ktime_t start = READ_ONCE(port->tx_done);
+
+	if (ktime_before(start, now))
+		start = now;
+
+	WRITE_ONCE(port->tx_done,
+		   ktime_add_ns(start, len * ft260_uart_char_time_ns(port)));
+}
+
+/*
+ * In the RS-485 mode, the TX_ACTIVE pin enables the bus driver while the chip
+ * transmits. Unless SER_RS485_RX_DURING_TX is set, the data received until
+ * delay_rts_after_send after the transmission end is our own echo.
+ */
+static bool ft260_uart_rs485_rx_blocked(struct ft260_device *port)
+{
+	u32 flags = READ_ONCE(port->rs485.flags);
+	ktime_t resume;
+
+	if (!(flags & SER_RS485_ENABLED) || (flags & SER_RS485_RX_DURING_TX))
+		return false;
+
+	resume = ktime_add_ms(READ_ONCE(port->tx_done),
+			      READ_ONCE(port->rs485.delay_rts_after_send));
+
+	return ktime_before(ktime_get(), resume);
+}
+
+/*
+ * Send the queued data in reports of up to FT260_WR_UART_DATA_MAX bytes. The
+ * payload is copied straight from the ring regions into the report buffer,
+ * and the ring space is released only once the report is sent.
+ */
+static int ft260_uart_transmit_chars(struct ft260_device *port)
+{
+	struct hid_device *hdev = port->hdev;
+	struct ft260_xmit_ring *xmit = &port->xmit;
+	struct tty_struct *tty;
+	struct ft260_uart_write_request_report *rep;
+	unsigned int len, part;
+	ktime_t start;
+	u8 *data;
+	int ret = 0;
+
+	mutex_lock(&port->tx_lock);
+	down_read(&port->chip->traffic_lock);
+	tty = tty_port_tty_get(&port->port);
+
+	ft260_xmit_flush_pending(port);
+
+	if (!tty || !ft260_xmit_len(xmit)) {
+		ret = -EINVAL;
+		goto tty_out;
+	}
+
+	rep = (struct ft260_uart_write_request_report *)port->uart_wr_buf;
+
+	/* Bus turnaround time before the transmitter starts from idle */
+	if ((port->rs485.flags & SER_RS485_ENABLED) &&
+	    port->rs485.delay_rts_before_send &&
+	    ktime_before(READ_ONCE(port->tx_done), ktime_get()))
+		msleep(port->rs485.delay_rts_before_send);
+
+	for (;;) {
+		ft260_xmit_flush_pending(port);
+
+		len = ft260_xmit_peek(xmit, &data);
+		if (!len)
+			break;
+
+		len = min_t(unsigned int, len, FT260_WR_UART_DATA_MAX);
+		memcpy(rep->data, data, len);
+
+		/* Fill the report from the ring start after a wrap */
+		if (len < FT260_WR_UART_DATA_MAX &&
+		    data + len == xmit->buf + xmit->size &&
+		    ft260_xmit_len(xmit) > len) {
+			part = min_t(unsigned int, ft260_xmit_len(xmit) - len,
+				     FT260_WR_UART_DATA_MAX - len);
+			memcpy(rep->data + len, xmit->buf, part);
+			len += part;
+		}
+
+		rep->report = FT260_UART_DATA_REPORT_ID(len);
+		rep->length = len;
+
+		start = ktime_get();
+		if (port->urb_out_en) {
+			ret = ft260_urb_out_submit(port, (u8 *)rep, len + 2,
+						   NULL);
+		} else {
+			/* uart_wr_buf is DMA-safe, skip the kmemdup bounce */
+			ret = hid_hw_output_report(hdev, (u8 *)rep, len + 2);
+			trace_ft260_output_report(hdev, rep->report, len + 2,
+						  ret, start);
+			if (ret >= 0)
+				ft260_activity(hdev);
+		}
+		ft260_flight_record(port, FT260_FLIGHT_UART_TX, rep->report, 0,
+				    0, len, ret,
+				    ktime_to_ns(ktime_sub(ktime_get(), start)), 0);
+		/* The data of a failed report is dropped */
+		ft260_xmit_consume(xmit, len);
+		if (ret < 0)
+			goto tty_out;
+
+		port->icount.tx += len;
+		ft260_uart_tx_done_update(port, len);
+	}
+
+	ret = 0;
+
+tty_out:
+	tty_kref_put(tty);
+	up_read(&port->chip->traffic_lock);
+	mutex_unlock(&port->tx_lock);
+	return ret;
+}
+
+/*
+ * Low latency mode transmitter. Running from the SCHED_FIFO worker keeps
+ * the output reports from being delayed by the scheduling of the writer.
+ */
+static void ft260_uart_tx_work(struct kthread_work *work)
+{
+	struct ft260_device *port =
+		container_of(work, struct ft260_device, tx_work);
+	int ret;
+
+	ret = ft260_uart_transmit_chars(port);
+	if (ret < 0 && ret != -EINVAL)
+		ft260_dbg_uart("failed to transmit %d\n", ret);
+
+	tty_port_tty_wakeup(&port->port);
+}
+
+/* Called with rx_lock held */
+static void ft260_uart_rx_push(struct ft260_device *port)
+{
+	hrtimer_try_to_cancel(&port->rx_push_timer);
+
+	if (!port->rx_pending)
+		return;
+
+	port->rx_pending = 0;
+	port->rx_pushes++;
+	tty_flip_buffer_push(&port->port);
+}
+
+/*
+ * Move the data held in the staging ring into the flip buffer.
+ * Called with rx_lock held.
+ */
+static void ft260_uart_rx_drain(struct ft260_device *port)
+{
+	unsigned char *buf;
+	unsigned int len;
+	int ret;
+
+	if (!kfifo_initialized(&port->rx_ring))
+		return;
+
+	while ((len = kfifo_len(&port->rx_ring))) {
+		ret = tty_prepare_flip_string(&port->port, &buf, len);
+		if (ret <= 0)
+			break;
+
+		ret = kfifo_out(&port->rx_ring, buf, ret);
+		port->rx_pending += ret;
+	}
+}
+
+/*
+ * Account the received data that did not fit into the flip buffer nor into
+ * the staging ring. The overrun counter is incremented per event, and the
+ * number of lost bytes is accumulated in the buf_overrun counter.
+ * Called with rx_lock held.
+ */
+static void ft260_uart_rx_overrun(struct ft260_device *port, int lost)
+{
+	port->icount.overrun++;
+	port->icount.buf_overrun += lost;
+
+	if (tty_insert_flip_char(&port->port, 0, TTY_OVERRUN))
+		port->rx_pending++;
+
+	ft260_dbg_uart("%d char not inserted to flip buf\n", lost);
+}
+
+static enum hrtimer_restart ft260_uart_rx_push_timeout(struct hrtimer *t)
+{
+	struct ft260_device *port =
+		container_of(t, struct ft260_device, rx_push_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&port->rx_lock, flags);
+	ft260_uart_rx_drain(port);
+	ft260_uart_rx_push(port);
+	spin_unlock_irqrestore(&port->rx_lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Record the arrival time of the input report in the timestamp ring, and
+ * account the gap to the previous report and the report fill level in the
+ * histograms exposed via debugfs. Called with rx_lock held.
+ */
+static void ft260_uart_rx_stamp(struct ft260_device *port, u8 length,
+				ktime_t ts)
+{
+	struct ft260_uart_rx_stamp *stamp;
+	s64 gap;
+
+	stamp = &port->rx_ts[port->rx_ts_count++ & (FT260_UART_RX_TS_RING - 1)];
+	stamp->ts = ts;
+	stamp->len = length;
+
+	if (port->rx_last) {
+		gap = ktime_us_delta(ts, port->rx_last);
+		port->rx_gap_hist[gap > 0 ?
+			min_t(int, ilog2(gap) + 1, FT260_UART_GAP_BUCKETS - 1) :
+			0]++;
+	}
+	port->rx_last = ts;
+
+	port->rx_fill_hist[min_t(int, length, FT260_UART_FILL_BUCKETS - 1)]++;
+}
+
+/* Called with rx_lock held */
+static void ft260_uart_rx_frame_reset(struct ft260_device *port)
+{
+	port->rx_frame_len = 0;
+	port->rx_frame_skip = 0;
+}
+
+/*
+ * Queue the reassembled frame to the flip buffer, prefixed with the
+ * CLOCK_MONOTONIC time in nanoseconds of the report that carried its first
+ * byte when packet_timestamp is set. A frame is never split, so if the
+ * flip buffer has no room for it, the whole frame is accounted as overrun.
+ * No TTY_OVERRUN marker is inserted, as it would break the framing.
+ * Called with rx_lock held.
+ */
+static void ft260_uart_rx_frame_deliver(struct ft260_device *port)
+{
+	unsigned int len = port->rx_frame_len;
+	unsigned int size = len;
+	u64 ts;
+
+	if (port->packet_timestamp)
+		size += sizeof(ts);
+
+	if (tty_buffer_request_room(&port->port, size) < size) {
+		port->icount.overrun++;
+		port->icount.buf_overrun += len;
+	} else {
+		if (port->packet_timestamp) {
+			ts = ktime_to_ns(port->rx_frame_ts);
+			tty_insert_flip_string(&port->port, (u8 *)&ts,
+					       sizeof(ts));
+		}
+		tty_insert_flip_string(&port->port, port->rx_frame, len);
+		port->rx_pending += size;
+		port->rx_frames++;
+	}
+
+	port->rx_frame_len = 0;
+}
+
+/*
+ * Packet mode accumulates the received bytes and hands only complete frames
+ * to the line discipline, so the reader gets one wakeup per frame instead of
+ * one per input report. A frame either ends with packet_delimiter, which is
+ * included, or starts with a packet_header bytes long big endian length of
+ * the payload that follows it. Frames longer than FT260_UART_FRAME_MAX are
+ * dropped up to the next frame boundary.
+ * Called with rx_lock held.
+ */
+static void ft260_uart_rx_packet(struct ft260_device *port, u8 *data,
+				 u8 length, ktime_t ts)
+{
+	unsigned int size;
+	u8 c;
+	int i;
+
+	for (i = 0; i < length; i++) {
+		c = data[i];
+
+		if (port->rx_frame_skip) {
+			if (port->packet_mode == FT260_UART_PACKET_DELIM) {
+				if (c == port->packet_delimiter)
+					port->rx_frame_skip = 0;
+			} else {
+				port->rx_frame_skip--;
+			}
+			continue;
+		}
+
+		if (!port->rx_frame_len)
+			port->rx_frame_ts = ts;
+		port->rx_frame[port->rx_frame_len++] = c;
+
+		if (port->packet_mode == FT260_UART_PACKET_DELIM) {
+			if (c == port->packet_delimiter) {
+				ft260_uart_rx_frame_deliver(port);
+			} else if (port->rx_frame_len == FT260_UART_FRAME_MAX) {
+				port->rx_frames_dropped++;
+				port->rx_frame_len = 0;
+				port->rx_frame_skip = 1;
+			}
+			continue;
+		}
+
+		if (port->rx_frame_len < port->packet_header)
+			continue;
+
+		size = port->packet_header;
+		size += port->packet_header == 1 ? port->rx_frame[0] :
+			get_unaligned_be16(port->rx_frame);
+
+		if (size > FT260_UART_FRAME_MAX) {
+			port->rx_frames_dropped++;
+			port->rx_frame_skip = size - port->rx_frame_len;
+			port->rx_frame_len = 0;
+		} else if (port->rx_frame_len == size) {
+			ft260_uart_rx_frame_deliver(port);
+		}
+	}
+}
+
+/*
+ * The input report payload is copied straight into the space reserved in the
+ * flip buffer. Every flip buffer push schedules the ldisc work, so instead of
+ * pushing each report of at most 60 bytes, the pushes are coalesced until
+ * either rx_push_threshold bytes are pending or the rx_push_delay_us window
+ * expires. In the low latency mode, the data is pushed per report.
+ *
+ * When the flip buffer is full, because the line discipline is throttled,
+ * the rest of the data is kept in the optional staging ring until the tty
+ * is unthrottled. Whatever does not fit there is accounted as an overrun.
+ *
+ * In packet mode, the data is pushed per completed frame instead.
+ */
+static int ft260_uart_receive_chars(struct ft260_device *port, u8 *data,
+				    u8 length, ktime_t ts)
+{
+	unsigned char *buf;
+	unsigned long flags;
+	int ret = 0, len;
+
+	if (ft260_uart_rs485_rx_blocked(port)) {
+		ft260_dbg_uart("%d echo chars discarded\n", length);
+		return length;
+	}
+
+	spin_lock_irqsave(&port->rx_lock, flags);
+
+	ft260_uart_rx_stamp(port, length, ts);
+	ft260_uart_rx_drain(port);
+
+	if (port->packet_mode) {
+		ft260_uart_rx_packet(port, data, length, ts);
+		port->icount.rx += length;
+		ft260_uart_rx_push(port);
+		spin_unlock_irqrestore(&port->rx_lock, flags);
+		return length;
+	}
+
+	/* Keep the order of the data behind the already staged bytes */
+	if (!kfifo_initialized(&port->rx_ring) ||
+	    kfifo_is_empty(&port->rx_ring)) {
+		ret = tty_prepare_flip_string(&port->port, &buf, length);
+		if (ret > 0)
+			memcpy(buf, data, ret);
+		else
+			ret = 0;
+		port->rx_pending += ret;
+	}
+
+	if (ret != length && kfifo_initialized(&port->rx_ring)) {
+		len = kfifo_in(&port->rx_ring, data + ret, length - ret);
+		ret += len;
+	}
+
+	if (ret != length)
+		ft260_uart_rx_overrun(port, length - ret);
+
+	port->icount.rx += ret;
+
+	/*
+	 * serdev clients get their receive_buf callback from the flip buffer
+	 * work, which is process context and is allowed to sleep. Calling it
+	 * from here would break that contract, so just do not hold the data
+	 * back in the coalescing timer.
+	 */
+	if (port->low_latency || port->serdev || !port->rx_push_delay_us ||
+	    port->rx_pending >= port->rx_push_threshold)
+		ft260_uart_rx_push(port);
+	else if ((port->rx_pending || (kfifo_initialized(&port->rx_ring) &&
+				       !kfifo_is_empty(&port->rx_ring))) &&
+		 !hrtimer_is_queued(&port->rx_push_timer))
+		hrtimer_start(&port->rx_push_timer,
+			      us_to_ktime(port->rx_push_delay_us),
+			      HRTIMER_MODE_REL);
+
+	spin_unlock_irqrestore(&port->rx_lock, flags);
+
+	return ret;
+}
+
+static int ft260_uart_write(struct tty_struct *tty, const u8 *buf, int cnt)
+{
+	struct ft260_device *port = tty->driver_data;
+	struct kthread_worker *worker;
+	int len, ret;
+
+	len = ft260_xmit_put(&port->xmit, buf, cnt);
+	ft260_dbg_uart("count: %d, len: %d", cnt, len);
+
+	spin_lock(&port->tx_worker_lock);
+	worker = port->tx_worker;
+	if (worker)
+		kthread_queue_work(worker, &port->tx_work);
+	spin_unlock(&port->tx_worker_lock);
+	if (worker)
+		return len;
+
+	ret = ft260_uart_transmit_chars(port);
+	if (ret < 0)
+		ft260_dbg_uart("failed to transmit %d\n", ret);
+
+	return len;
+}
+
+static void ft260_uart_unthrottle(struct tty_struct *tty)
 {
-	int ret;
 	struct ft260_device *port = tty->driver_data;
+	unsigned long flags;
 
-	ret = tty_port_open(&port->port, tty, filp);
-
-	return ret;
+	spin_lock_irqsave(&port->rx_lock, flags);
+	ft260_uart_rx_drain(port);
+	ft260_uart_rx_push(port);
+	spin_unlock_irqrestore(&port->rx_lock, flags);
 }
 
-static void ft260_uart_close(struct tty_struct *tty, struct file *filp)
+static unsigned int ft260_uart_write_room(struct tty_struct *tty)
 {
 	struct ft260_device *port = tty->driver_data;
 
-	tty_port_close(&port->port, tty, filp);
+	return ft260_xmit_avail(&port->xmit);
 }
 
-static void ft260_uart_hangup(struct tty_struct *tty)
+static unsigned int ft260_uart_chars_in_buffer(struct tty_struct *tty)
 {
 	struct ft260_device *port = tty->driver_data;
 
-	tty_port_hangup(&port->port);
+	return ft260_xmit_len(&port->xmit);
 }
 
-static int ft260_uart_transmit_chars(struct ft260_device *port)
+/*
+ * Only the consumer may move the tail, so if the transmitter is busy, the
+ * discard is left to it.
+ */
+static void ft260_uart_flush_buffer(struct tty_struct *tty)
 {
-	struct hid_device *hdev = port->hdev;
-	struct kfifo *xmit = &port->xmit_fifo;
-	struct tty_struct *tty;
-	struct ft260_uart_write_request_report *rep;
-	int len, data_len, ret = 0;
-
-	tty = tty_port_tty_get(&port->port);
+	struct ft260_device *port = tty->driver_data;
+	unsigned int head = smp_load_acquire(&port->xmit.head);
 
-	data_len = kfifo_len(xmit);
-	if (!tty || !data_len) {
-		ret = -EINVAL;
-		goto tty_out;
+	if (mutex_trylock(&port->tx_lock)) {
+		ft260_xmit_discard_to(port, head);
+		mutex_unlock(&port->tx_lock);
+	} else {
+		/* The running transmitter discards the data up to head */
+		WRITE_ONCE(port->xmit_flush_head, head);
+		smp_store_release(&port->xmit_flush, true);
 	}
 
-	rep = (struct ft260_uart_write_request_report *)port->uart_wr_buf;
-
-	do {
-		len = min(data_len, FT260_WR_UART_DATA_MAX);
+	tty_wakeup(tty);
+}
 
-		rep->report = FT260_UART_DATA_REPORT_ID(len);
-		rep->length = len;
+/*
+ * The chars_in_buffer() count drops to zero once the data is handed to the
+ * chip, while the chip may still be shifting it out. The end of that is
+ * estimated from the line settings, see ft260_uart_tx_done_update().
+ */
+static void ft260_uart_wait_until_sent(struct tty_struct *tty, int timeout)
+{
+	struct ft260_device *port = tty->driver_data;
+	s64 left = ktime_us_delta(READ_ONCE(port->tx_done), ktime_get());
+	unsigned long delay;
 
-		len = kfifo_out_spinlocked(xmit, rep->data, len, &port->xmit_fifo_lock);
+	if (left <= 0)
+		return;
 
-		ret = ft260_hid_output_report(hdev, (u8 *)rep, len + 2);
-		if (ret < 0)
-			goto tty_out;
+	ft260_dbg_uart("%lld us left to send\n", left);
 
-		data_len -= len;
-		port->icount.tx += len;
-	} while (data_len > 0);
+	if (left < jiffies_to_usecs(1)) {
+		usleep_range(left, left + 50);
+		return;
+	}
 
-	ret = 0;
+	delay = usecs_to_jiffies(left);
+	if (timeout)
+		delay = min_t(unsigned long, delay, timeout);
 
-tty_out:
-	tty_kref_put(tty);
-	return ret;
+	schedule_timeout_interruptible(delay);
 }
 
-static int ft260_uart_receive_chars(struct ft260_device *port, u8 *data, u8 length)
+static int ft260_uart_break_ctl(struct tty_struct *tty, int break_state)
 {
+	struct ft260_device *port = tty->driver_data;
+	struct ft260_set_uart_breaking_report rep;
 	int ret;
 
-	ret = tty_insert_flip_string(&port->port, data, length);
-	if (ret != length)
-		ft260_dbg("%d char not inserted to flip buf\n", length - ret);
+	rep.report = FT260_SYSTEM_SETTINGS;
+	rep.request = FT260_SET_UART_BREAKING;
+	rep.breaking = break_state ? FT260_UART_CFG_BREAKING_YES :
+				     FT260_UART_CFG_BREAKING_NO;
 
-	port->icount.rx += ret;
+	mutex_lock(&port->lock);
+	ret = ft260_hid_feature_report_set(port->hdev, (u8 *)&rep, sizeof(rep));
+	if (ret < 0)
+		hid_err(port->hdev, "failed to set break: %d\n", ret);
+	else
+		port->uart_cfg.breaking = rep.breaking;
+	mutex_unlock(&port->lock);
 
-	if (ret)
-		tty_flip_buffer_push(&port->port);
+	return ret < 0 ? ret : 0;
+}
 
-	return ret;
+static int ft260_uart_set_xon_xoff(struct hid_device *hdev, u8 xon, u8 xoff)
+{
+	struct ft260_set_uart_xon_xoff_report rep;
+
+	rep.report = FT260_SYSTEM_SETTINGS;
+	rep.request = FT260_SET_UART_XON_XOFF;
+	rep.xon = xon;
+	rep.xoff = xoff;
+
+	ft260_dbg_config("xon %#02x xoff %#02x\n", xon, xoff);
+
+	return ft260_hid_feature_report_set(hdev, (u8 *)&rep, sizeof(rep));
 }
 
-static int ft260_uart_write(struct tty_struct *tty, const u8 *buf, int cnt)
+/*
+ * Program the cached configuration into the chip again, after a UART reset
+ * or a system clock change. Called with port->lock held.
+ */
+static int ft260_uart_config_restore(struct ft260_device *port)
 {
-	struct ft260_device *port = tty->driver_data;
-	int len, ret, diff;
+	struct hid_device *hdev = port->hdev;
+	int ret;
 
-	len = kfifo_in_spinlocked(&port->xmit_fifo, buf, cnt, &port->xmit_fifo_lock);
-	ft260_dbg("count: %d, len: %d", cnt, len);
+	if (!port->uart_cfg_valid)
+		return 0;
 
-	ret = ft260_uart_transmit_chars(port);
+	ret = ft260_hid_feature_report_set(hdev, (u8 *)&port->uart_cfg,
+					   sizeof(port->uart_cfg));
 	if (ret < 0) {
-		ft260_dbg("failed to transmit %d\n", ret);
-		return 0;
+		port->uart_cfg_valid = false;
+		return ret;
 	}
 
-	ret = kfifo_len(&port->xmit_fifo);
-	if (ret > 0) {
-		diff = len - ret;
-		ft260_dbg("failed to send %d out of %d bytes\n", diff, len);
-		return diff;
-	}
+	if (port->uart_cfg.flow_ctrl == FT260_UART_CFG_FLOW_CTRL_XON_XOFF)
+		ret = ft260_uart_set_xon_xoff(hdev, port->uart_xon,
+					      port->uart_xoff);
 
-	return len;
+	return ret;
 }
 
-static unsigned int ft260_uart_write_room(struct tty_struct *tty)
+/*
+ * Reset the UART of the chip, which discards the data held in its FIFOs,
+ * and program the cached configuration again, since the reset may revert
+ * it. Called with port->lock held.
+ */
+static int ft260_uart_chip_reset(struct ft260_device *port)
 {
-	struct ft260_device *port = tty->driver_data;
+	struct ft260_uart_reset_report rep;
+	struct hid_device *hdev = port->hdev;
+	int ret;
+
+	rep.report = FT260_SYSTEM_SETTINGS;
+	rep.request = FT260_SET_UART_RESET;
+
+	ret = ft260_hid_feature_report_set(hdev, (u8 *)&rep, sizeof(rep));
+	if (ret < 0)
+		return ret;
+
+	WRITE_ONCE(port->tx_done, ktime_get());
 
-	return kfifo_avail(&port->xmit_fifo);
+	return ft260_uart_config_restore(port);
 }
 
-static unsigned int ft260_uart_chars_in_buffer(struct tty_struct *tty)
+/*
+ * Program the UART configuration into the chip, skipping the USB transfer
+ * when nothing has changed since the last programming. A change of a single
+ * field is sent as the field-specific request instead of the full config.
+ * Called with port->lock held.
+ */
+static int ft260_uart_config_set(struct ft260_device *port,
+				 struct ft260_configure_uart_request_report *req)
 {
-	struct ft260_device *port = tty->driver_data;
+	struct ft260_configure_uart_request_report *cur = &port->uart_cfg;
+	struct hid_device *hdev = port->hdev;
+	union {
+		struct ft260_set_uart_baud_rate_report baud;
+		struct ft260_set_uart_data_bit_report data_bit;
+		struct ft260_set_uart_parity_report parity;
+		struct ft260_set_uart_stop_bit_report stop_bit;
+	} rep;
+	int ret, len = 0, changed = 0;
+
+	if (!port->uart_cfg_valid || req->flow_ctrl != cur->flow_ctrl ||
+	    req->breaking != cur->breaking)
+		goto full_config;
+
+	if (get_unaligned_le32(&req->baudrate) !=
+	    get_unaligned_le32(&cur->baudrate)) {
+		rep.baud.request = FT260_SET_UART_BAUD_RATE;
+		put_unaligned_le32(get_unaligned_le32(&req->baudrate),
+				   &rep.baud.baudrate);
+		len = sizeof(rep.baud);
+		changed++;
+	}
+	if (req->data_bit != cur->data_bit) {
+		rep.data_bit.request = FT260_SET_UART_DATA_BIT;
+		rep.data_bit.data_bit = req->data_bit;
+		len = sizeof(rep.data_bit);
+		changed++;
+	}
+	if (req->parity != cur->parity) {
+		rep.parity.request = FT260_SET_UART_PARITY;
+		rep.parity.parity = req->parity;
+		len = sizeof(rep.parity);
+		changed++;
+	}
+	if (req->stop_bit != cur->stop_bit) {
+		rep.stop_bit.request = FT260_SET_UART_STOP_BIT;
+		rep.stop_bit.stop_bit = req->stop_bit;
+		len = sizeof(rep.stop_bit);
+		changed++;
+	}
+
+	if (!changed) {
+		ft260_dbg_config("uart config unchanged\n");
+		return 0;
+	}
+
+	if (changed == 1) {
+		/* The report field is at the same offset in all the reports */
+		rep.baud.report = FT260_SYSTEM_SETTINGS;
+		ft260_dbg_config("request %#02x\n", rep.baud.request);
+		ret = ft260_hid_feature_report_set(hdev, (u8 *)&rep, len);
+		goto exit;
+	}
+
+full_config:
+	ret = ft260_hid_feature_report_set(hdev, (u8 *)req, sizeof(*req));
+exit:
+	if (ret < 0) {
+		port->uart_cfg_valid = false;
+		return ret;
+	}
 
-	return kfifo_len(&port->xmit_fifo);
+	*cur = *req;
+	port->uart_cfg_valid = true;
+	return ret;
 }
 
 static int ft260_uart_change_speed(struct ft260_device *port,
@@ -1754,6 +4578,7 @@ static int ft260_uart_change_speed(struct ft260_device *port,
 	unsigned int baud;
 	struct ft260_configure_uart_request_report req;
 	bool wakeup_workaraund = false;
+	bool flow_changed;
 	int ret;
 
 	memset(&req, 0, sizeof(req));
@@ -1805,28 +4630,63 @@ static int ft260_uart_change_speed(struct ft260_device *port,
 
 	put_unaligned_le32(cpu_to_le32(baud), &req.baudrate);
 
+	/*
+	 * There is no termios flag for the DTR/DSR handshake, so it is
+	 * selected via the flow_dtr_dsr port attribute in place of RTS/CTS.
+	 */
 	if (termios->c_cflag & CRTSCTS)
-		req.flow_ctrl = FT260_UART_CFG_FLOW_CTRL_RTS_CTS;
+		req.flow_ctrl = port->flow_dtr_dsr ?
+			FT260_UART_CFG_FLOW_CTRL_DTR_DSR :
+			FT260_UART_CFG_FLOW_CTRL_RTS_CTS;
+	else if (termios->c_iflag & (IXON | IXOFF))
+		req.flow_ctrl = FT260_UART_CFG_FLOW_CTRL_XON_XOFF;
 	else
-		req.flow_ctrl = FT260_UART_CFG_FLOW_CTRL_OFF;
-
-	ft260_dbg("configured termios: flow control: %d, baudrate: %d, ",
-		  req.flow_ctrl, baud);
-	ft260_dbg("data_bit: %d, parity: %d, stop_bit: %d, breaking: %d\n",
-		  req.data_bit, req.parity,
-		  req.stop_bit, req.breaking);
+		req.flow_ctrl = FT260_UART_CFG_FLOW_CTRL_NONE;
 
-	req.flow_ctrl = FT260_UART_CFG_FLOW_CTRL_NONE;
 	req.breaking = FT260_UART_CFG_BREAKING_NO;
 
-	mutex_lock(&port->lock);
+	ft260_dbg_config("configured termios: flow control: %d, baudrate: %d, ",
+			 req.flow_ctrl, baud);
+	ft260_dbg_config("data_bit: %d, parity: %d, stop_bit: %d, breaking: %d\n",
+			 req.data_bit, req.parity,
+			 req.stop_bit, req.breaking);
 
-	ret = ft260_hid_feature_report_set(hdev, (u8 *)&req, sizeof(req));
+	/* Taken before port->lock, the clock change programs the UART again */
+	ret = ft260_sysclk_set_uart(port, baud);
 	if (ret < 0)
+		return ret;
+
+	mutex_lock(&port->lock);
+
+	/* A break in progress is ended by break_ctl() only */
+	if (port->uart_cfg_valid)
+		req.breaking = port->uart_cfg.breaking;
+
+	flow_changed = !port->uart_cfg_valid ||
+		       port->uart_cfg.flow_ctrl != req.flow_ctrl;
+
+	ret = ft260_uart_config_set(port, &req);
+	if (ret < 0) {
 		hid_err(hdev, "failed to change termios: %d\n", ret);
-	else
+		goto exit;
+	}
+
+	if (flow_changed)
 		ft260_gpio_en_update(hdev, FT260_SET_UART_MODE, req.flow_ctrl);
 
+	if (req.flow_ctrl == FT260_UART_CFG_FLOW_CTRL_XON_XOFF &&
+	    (flow_changed || port->uart_xon != termios->c_cc[VSTART] ||
+	     port->uart_xoff != termios->c_cc[VSTOP])) {
+		ret = ft260_uart_set_xon_xoff(hdev, termios->c_cc[VSTART],
+					      termios->c_cc[VSTOP]);
+		if (ret < 0) {
+			hid_err(hdev, "failed to set XON/XOFF chars: %d\n", ret);
+			goto exit;
+		}
+		port->uart_xon = termios->c_cc[VSTART];
+		port->uart_xoff = termios->c_cc[VSTOP];
+	}
+exit:
 	mutex_unlock(&port->lock);
 
 	return ret;
@@ -1836,10 +4696,318 @@ static int ft260_uart_get_icount(struct tty_struct *tty,
 		struct serial_icounter_struct *icount)
 {
 	struct ft260_device *port = tty->driver_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&port->rx_lock, flags);
+	memcpy(icount, &port->icount, sizeof(struct uart_icount));
+	spin_unlock_irqrestore(&port->rx_lock, flags);
+
+	return 0;
+}
+
+static int ft260_uart_set_mctrl(struct ft260_device *port, unsigned int mctrl)
+{
+	u8 vals = 0;
+	int ret;
+
+	/* The modem control pins are active-low */
+	if (!(mctrl & TIOCM_RTS))
+		vals |= FT260_UART_PIN_RTS;
+	if (!(mctrl & TIOCM_DTR))
+		vals |= FT260_UART_PIN_DTR;
+
+	ret = ft260_gpio_ex_set(port->hdev,
+				FT260_UART_PIN_RTS | FT260_UART_PIN_DTR, vals);
+	if (ret < 0)
+		return ret;
+
+	port->mctrl = mctrl & (TIOCM_RTS | TIOCM_DTR);
+	return 0;
+}
+
+static int ft260_uart_tiocmget(struct tty_struct *tty)
+{
+	struct ft260_device *port = tty->driver_data;
+	u16 gpio_en = port->chip->gpio_en;
+	int result = port->mctrl;
+	u8 ex_vals;
+	int ret;
+
+	if (port->dcd_ri & FT260_UART_DCD)
+		result |= TIOCM_CD;
+	if (port->dcd_ri & FT260_UART_RI)
+		result |= TIOCM_RI;
+
+	/* CTS and DSR are readable only when not taken by the flow control */
+	if (gpio_en & (FT260_GPIO_E | FT260_GPIO_H)) {
+		ret = ft260_gpio_ex_get(port->hdev, &ex_vals);
+		if (ret < 0)
+			return ret;
+
+		if ((gpio_en & FT260_GPIO_E) && !(ex_vals & FT260_UART_PIN_CTS))
+			result |= TIOCM_CTS;
+		if ((gpio_en & FT260_GPIO_H) && !(ex_vals & FT260_UART_PIN_DSR))
+			result |= TIOCM_DSR;
+	}
+
+	ft260_dbg_uart("result %#x\n", result);
+	return result;
+}
+
+static int ft260_uart_tiocmset(struct tty_struct *tty,
+			       unsigned int set, unsigned int clear)
+{
+	struct ft260_device *port = tty->driver_data;
+
+	return ft260_uart_set_mctrl(port, (port->mctrl | set) & ~clear);
+}
+
+static bool ft260_uart_modem_changed(struct ft260_device *port,
+				     unsigned long mask,
+				     struct uart_icount *prev)
+{
+	struct uart_icount cnow;
+	unsigned long flags;
+	bool ret;
+
+	if (!tty_port_initialized(&port->port))
+		return true;
+
+	spin_lock_irqsave(&port->rx_lock, flags);
+	cnow = port->icount;
+	spin_unlock_irqrestore(&port->rx_lock, flags);
+
+	ret = ((mask & TIOCM_RNG) && (cnow.rng != prev->rng)) ||
+	      ((mask & TIOCM_DSR) && (cnow.dsr != prev->dsr)) ||
+	      ((mask & TIOCM_CD) && (cnow.dcd != prev->dcd)) ||
+	      ((mask & TIOCM_CTS) && (cnow.cts != prev->cts));
+
+	*prev = cnow;
+	return ret;
+}
+
+static int ft260_uart_tiocmiwait(struct ft260_device *port, unsigned long arg)
+{
+	struct uart_icount cprev;
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&port->rx_lock, flags);
+	cprev = port->icount;
+	spin_unlock_irqrestore(&port->rx_lock, flags);
+
+	ret = wait_event_interruptible(port->port.delta_msr_wait,
+			ft260_uart_modem_changed(port, arg, &cprev));
+	if (ret)
+		return ret;
+
+	if (!tty_port_initialized(&port->port))
+		return -EIO;
+
+	return 0;
+}
+
+static int ft260_uart_get_rs485(struct ft260_device *port,
+				struct serial_rs485 __user *arg)
+{
+	if (copy_to_user(arg, &port->rs485, sizeof(port->rs485)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * The chip drives the bus enable via the TX_ACTIVE function of the GPIOA pin
+ * while it transmits. The driver honours the RTS delays by postponing the
+ * transmission start and by extending the receive echo suppression window.
+ */
+static int ft260_uart_set_rs485(struct ft260_device *port,
+				struct serial_rs485 __user *arg)
+{
+	struct hid_device *hdev = port->hdev;
+	struct ft260_set_gpioa_func_report rep;
+	struct serial_rs485 rs485;
+	int ret = 0;
+
+	if (copy_from_user(&rs485, arg, sizeof(rs485)))
+		return -EFAULT;
+
+	/* TX_ACTIVE is asserted high during the transmission only */
+	rs485.flags &= SER_RS485_ENABLED | SER_RS485_RX_DURING_TX;
+	if (rs485.flags & SER_RS485_ENABLED)
+		rs485.flags |= SER_RS485_RTS_ON_SEND;
+
+	rs485.delay_rts_before_send = min_t(u32, rs485.delay_rts_before_send,
+					    FT260_RS485_DELAY_MAX_MS);
+	rs485.delay_rts_after_send = min_t(u32, rs485.delay_rts_after_send,
+					   FT260_RS485_DELAY_MAX_MS);
+	memset(rs485.padding, 0, sizeof(rs485.padding));
+
+	mutex_lock(&port->lock);
+
+	if ((rs485.flags ^ port->rs485.flags) & SER_RS485_ENABLED) {
+		rep.report = FT260_SYSTEM_SETTINGS;
+		rep.request = FT260_SELECT_GPIOA_FUNC;
+		rep.gpioa_func = (rs485.flags & SER_RS485_ENABLED) ?
+			FT260_MFPIN_TX_ACTIVE : FT260_MFPIN_GPIO;
+
+		ret = ft260_hid_feature_report_set(hdev, (u8 *)&rep,
+						   sizeof(rep));
+		if (ret < 0) {
+			hid_err(hdev, "failed to set GPIOA function: %d\n", ret);
+			goto exit;
+		}
+		ft260_gpio_en_update(hdev, FT260_SELECT_GPIOA_FUNC,
+				     rep.gpioa_func);
+	}
+
+	port->rs485 = rs485;
+	ret = 0;
+exit:
+	mutex_unlock(&port->lock);
+
+	if (ret)
+		return ret;
+
+	return ft260_uart_get_rs485(port, arg);
+}
+
+static int ft260_uart_get_serial(struct tty_struct *tty,
+				 struct serial_struct *ss)
+{
+	struct ft260_device *port = tty->driver_data;
+
+	ss->line = port->index;
+	ss->type = PORT_UNKNOWN;
+	ss->xmit_fifo_size = port->xmit.size;
+	ss->baud_base = FT260_UART_CFG_BAUD_MAX;
+	ss->close_delay = jiffies_to_msecs(port->port.close_delay) / 10;
+	ss->closing_wait = port->port.closing_wait == ASYNC_CLOSING_WAIT_NONE ?
+			   ASYNC_CLOSING_WAIT_NONE :
+			   jiffies_to_msecs(port->port.closing_wait) / 10;
+	if (port->low_latency)
+		ss->flags |= ASYNC_LOW_LATENCY;
+
+	return 0;
+}
+
+static int ft260_uart_set_serial(struct tty_struct *tty,
+				 struct serial_struct *ss)
+{
+	struct ft260_device *port = tty->driver_data;
+	bool low_latency = ss->flags & ASYNC_LOW_LATENCY;
+	struct serial_struct cur;
+	int ret = 0;
+
+	memset(&cur, 0, sizeof(cur));
+	ft260_uart_get_serial(tty, &cur);
+
+	/* Only the low latency flag can be changed */
+	if (ss->type != cur.type || ss->line != cur.line || ss->port ||
+	    ss->irq || ss->xmit_fifo_size != cur.xmit_fifo_size ||
+	    ss->baud_base != cur.baud_base || ss->custom_divisor ||
+	    ss->close_delay != cur.close_delay ||
+	    ss->closing_wait != cur.closing_wait ||
+	    (ss->flags & ~ASYNC_LOW_LATENCY))
+		return -EINVAL;
+
+	if (low_latency == port->low_latency)
+		return 0;
+
+	/* The mode runs a real-time kernel thread */
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	mutex_lock(&port->port.mutex);
+	ret = ft260_uart_low_latency_set(port, low_latency);
+	mutex_unlock(&port->port.mutex);
+
+	return ret;
+}
+
+/*
+ * Both directions are flushed in the chip by a UART reset, so it is done for
+ * TCIOFLUSH only, on top of the flushing done by the tty core.
+ */
+static void ft260_uart_flush_chip(struct ft260_device *port)
+{
+	int ret;
+
+	mutex_lock(&port->lock);
+	ret = ft260_uart_chip_reset(port);
+	mutex_unlock(&port->lock);
+	if (ret < 0)
+		hid_err(port->hdev, "failed to reset uart: %d\n", ret);
+
+	spin_lock_irq(&port->rx_lock);
+	if (kfifo_initialized(&port->rx_ring))
+		kfifo_reset(&port->rx_ring);
+	ft260_uart_rx_frame_reset(port);
+	spin_unlock_irq(&port->rx_lock);
+}
+
+static int ft260_uart_ioctl(struct tty_struct *tty, unsigned int cmd,
+			    unsigned long arg)
+{
+	struct ft260_device *port = tty->driver_data;
+
+	switch (cmd) {
+	case TIOCMIWAIT:
+		return ft260_uart_tiocmiwait(port, arg);
+	case TIOCGRS485:
+		return ft260_uart_get_rs485(port,
+				(struct serial_rs485 __user *)arg);
+	case TIOCSRS485:
+		return ft260_uart_set_rs485(port,
+				(struct serial_rs485 __user *)arg);
+	case TCFLSH:
+		if (arg == TCIOFLUSH)
+			ft260_uart_flush_chip(port);
+		/* Let the line discipline do the rest */
+		break;
+	}
+
+	return -ENOIOCTLCMD;
+}
+
+/*
+ * Update the DCD and RI state from the interrupt status report and wake up
+ * the TIOCMIWAIT waiters. Called from the HID raw event context.
+ */
+static void ft260_uart_modem_status(struct ft260_device *port, u8 dcd_ri)
+{
+	struct tty_struct *tty;
+	unsigned long flags;
+	u8 changed;
+
+	spin_lock_irqsave(&port->rx_lock, flags);
+	changed = port->dcd_ri ^ dcd_ri;
+	port->dcd_ri = dcd_ri;
+	if (changed & FT260_UART_DCD)
+		port->icount.dcd++;
+	if (changed & FT260_UART_RI)
+		port->icount.rng++;
+	spin_unlock_irqrestore(&port->rx_lock, flags);
+
+	ft260_dbg_uart("dcd_ri %#02x changed %#02x\n", dcd_ri, changed);
+
+	if (!changed)
+		return;
 
-	memcpy(icount, &port->icount, sizeof(struct uart_icount));
+	wake_up_interruptible(&port->port.delta_msr_wait);
 
-	return 0;
+	if (!(changed & FT260_UART_DCD))
+		return;
+
+	if (dcd_ri & FT260_UART_DCD) {
+		wake_up_interruptible(&port->port.open_wait);
+		return;
+	}
+
+	tty = tty_port_tty_get(&port->port);
+	if (tty && !C_CLOCAL(tty))
+		tty_hangup(tty);
+	tty_kref_put(tty);
 }
 
 static void ft260_uart_set_termios(struct tty_struct *tty,
@@ -1899,6 +5067,9 @@ static int ft260_uart_proc_show(struct seq_file *m, void *v)
 				if (port->icount.overrun)
 					seq_printf(m, " oe:%d",
 							port->icount.overrun);
+				if (port->icount.buf_overrun)
+					seq_printf(m, " bo:%d",
+							port->icount.buf_overrun);
 				if (port->icount.cts)
 					seq_printf(m, " cts:%d",
 							port->icount.cts);
@@ -1919,18 +5090,134 @@ static int ft260_uart_proc_show(struct seq_file *m, void *v)
 	return 0;
 }
 
+static int ft260_uart_rx_timestamps_show(struct seq_file *m, void *v)
+{
+	struct ft260_device *port = m->private;
+	struct ft260_uart_rx_stamp *stamps;
+	unsigned int i, n, count;
+
+	stamps = kmalloc_array(FT260_UART_RX_TS_RING, sizeof(*stamps),
+			       GFP_KERNEL);
+	if (!stamps)
+		return -ENOMEM;
+
+	/* Copy the ring out, the formatting is done with the IRQs on */
+	spin_lock_irq(&port->rx_lock);
+	count = port->rx_ts_count;
+	n = min_t(unsigned int, count, FT260_UART_RX_TS_RING);
+	for (i = 0; i < n; i++)
+		stamps[i] = port->rx_ts[(count - n + i) &
+					(FT260_UART_RX_TS_RING - 1)];
+	spin_unlock_irq(&port->rx_lock);
+
+	for (i = 0; i < n; i++)
+		seq_printf(m, "%lld %u\n", ktime_to_ns(stamps[i].ts),
+			   stamps[i].len);
+
+	kfree(stamps);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ft260_uart_rx_timestamps);
+
+static int ft260_uart_rx_histograms_show(struct seq_file *m, void *v)
+{
+	struct ft260_device *port = m->private;
+	u32 *gap, *fill;
+	int i;
+
+	gap = kmalloc_array(FT260_UART_GAP_BUCKETS + FT260_UART_FILL_BUCKETS,
+			    sizeof(*gap), GFP_KERNEL);
+	if (!gap)
+		return -ENOMEM;
+	fill = gap + FT260_UART_GAP_BUCKETS;
+
+	/* Copy the histograms out, the formatting is done with the IRQs on */
+	spin_lock_irq(&port->rx_lock);
+	memcpy(gap, port->rx_gap_hist, sizeof(port->rx_gap_hist));
+	memcpy(fill, port->rx_fill_hist, sizeof(port->rx_fill_hist));
+	spin_unlock_irq(&port->rx_lock);
+
+	seq_puts(m, "report gap (us):\n");
+	for (i = 0; i < FT260_UART_GAP_BUCKETS; i++) {
+		if (!gap[i])
+			continue;
+		if (i == 0)
+			seq_printf(m, "%10u %10u\n", 0, gap[i]);
+		else
+			seq_printf(m, "%10lu %10u\n", BIT(i - 1), gap[i]);
+	}
+	seq_puts(m, "report fill (bytes):\n");
+	for (i = 0; i < FT260_UART_FILL_BUCKETS; i++) {
+		if (fill[i])
+			seq_printf(m, "%10d %10u\n", i, fill[i]);
+	}
+
+	kfree(gap);
+	return 0;
+}
+
+static int ft260_uart_rx_histograms_open(struct inode *inode,
+					 struct file *file)
+{
+	return single_open(file, ft260_uart_rx_histograms_show,
+			   inode->i_private);
+}
+
+/* Any write resets the histograms */
+static ssize_t ft260_uart_rx_histograms_write(struct file *file,
+					      const char __user *buf,
+					      size_t count, loff_t *ppos)
+{
+	struct ft260_device *port =
+		((struct seq_file *)file->private_data)->private;
+
+	spin_lock_irq(&port->rx_lock);
+	memset(port->rx_gap_hist, 0, sizeof(port->rx_gap_hist));
+	memset(port->rx_fill_hist, 0, sizeof(port->rx_fill_hist));
+	port->rx_last = 0;
+	spin_unlock_irq(&port->rx_lock);
+
+	return count;
+}
+
+static const struct file_operations ft260_uart_rx_histograms_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ft260_uart_rx_histograms_open,
+	.read		= seq_read,
+	.write		= ft260_uart_rx_histograms_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void ft260_uart_debugfs_init(struct ft260_device *port)
+{
+	debugfs_create_file("rx_timestamps", 0400, port->debugfs, port,
+			    &ft260_uart_rx_timestamps_fops);
+	debugfs_create_file("rx_histograms", 0600, port->debugfs, port,
+			    &ft260_uart_rx_histograms_fops);
+}
+
 static const struct tty_operations ft260_uart_ops = {
 	.open			= ft260_uart_open,
 	.close			= ft260_uart_close,
 	.write			= ft260_uart_write,
 	.write_room		= ft260_uart_write_room,
 	.chars_in_buffer	= ft260_uart_chars_in_buffer,
+	.flush_buffer		= ft260_uart_flush_buffer,
+	.wait_until_sent	= ft260_uart_wait_until_sent,
+	.break_ctl		= ft260_uart_break_ctl,
+	.unthrottle		= ft260_uart_unthrottle,
 	.set_termios		= ft260_uart_set_termios,
 	.hangup			= ft260_uart_hangup,
 	.install		= ft260_uart_install,
 	.cleanup		= ft260_uart_cleanup,
 	.proc_show		= ft260_uart_proc_show,
 	.get_icount		= ft260_uart_get_icount,
+	.tiocmget		= ft260_uart_tiocmget,
+	.tiocmset		= ft260_uart_tiocmset,
+	.ioctl			= ft260_uart_ioctl,
+	.get_serial		= ft260_uart_get_serial,
+	.set_serial		= ft260_uart_set_serial,
 };
 
 /*
@@ -1941,19 +5228,30 @@ static const struct tty_operations ft260_uart_ops = {
  *
  * One effect of this mode is to cause data loss on an Rx line at baud
  * rates higher than 4800 after being idle for longer than 5 seconds.
- * We work around this by sending a dummy report at least once per 4.8
- * seconds if the UART is in use.
+ * We work around this by sending a dummy report if the UART is in use
+ * and no other report was exchanged with the chip for 4.8 seconds.
  */
 static void ft260_uart_start_wakeup(struct timer_list *t)
 {
 	struct ft260_device *dev =
 		container_of(t, struct ft260_device, wakeup_timer);
+	unsigned long idle_at;
 
-	if (dev->reschedule_work) {
-		schedule_work(&dev->wakeup_work);
-		mod_timer(&dev->wakeup_timer, jiffies +
-			msecs_to_jiffies(FT260_WAKEUP_NEEDED_AFTER_MS));
+	if (!dev->reschedule_work)
+		return;
+
+	idle_at = READ_ONCE(dev->chip->last_activity) +
+		  msecs_to_jiffies(FT260_WAKEUP_NEEDED_AFTER_MS);
+
+	if (time_before(jiffies, idle_at)) {
+		dev->keepalive_suppressed++;
+		mod_timer(&dev->wakeup_timer, idle_at);
+		return;
 	}
+
+	schedule_work(&dev->wakeup_work);
+	mod_timer(&dev->wakeup_timer, jiffies +
+		  msecs_to_jiffies(FT260_WAKEUP_NEEDED_AFTER_MS));
 }
 
 static void ft260_uart_wakeup(struct ft260_device *dev)
@@ -1966,6 +5264,8 @@ static void ft260_uart_wakeup(struct ft260_device *dev)
 						   (u8 *)&ver, sizeof(ver));
 		if (ret < 0)
 			hid_err(dev->hdev, "%s: failed with %d\n", __func__, ret);
+		else
+			dev->keepalive_sent++;
 	}
 }
 
@@ -1983,6 +5283,14 @@ static void ft260_uart_port_shutdown(struct tty_port *tport)
 		container_of(tport, struct ft260_device, port);
 
 	ft260_uart_wakeup_workaraund_enable(port, false);
+	hrtimer_cancel(&port->rx_push_timer);
+
+	spin_lock_irq(&port->rx_lock);
+	port->rx_pending = 0;
+	spin_unlock_irq(&port->rx_lock);
+
+	/* A closed port does not hold the system clock up */
+	ft260_sysclk_set_uart(port, 0);
 }
 
 static int ft260_uart_port_activate(struct tty_port *tport, struct tty_struct *tty)
@@ -1990,13 +5298,20 @@ static int ft260_uart_port_activate(struct tty_port *tport, struct tty_struct *t
 	int ret;
 	int baudrate;
 	struct ft260_get_uart_settings_report cfg;
+	struct ft260_get_uart_ri_dcd_status_report dcd_ri;
 	struct ft260_device *port = container_of(tport, struct ft260_device, port);
 
 	set_bit(TTY_IO_ERROR, &tty->flags);
 
-	spin_lock(&port->xmit_fifo_lock);
-	kfifo_reset(&port->xmit_fifo);
-	spin_unlock(&port->xmit_fifo_lock);
+	mutex_lock(&port->tx_lock);
+	ft260_xmit_discard(port);
+	mutex_unlock(&port->tx_lock);
+
+	spin_lock_irq(&port->rx_lock);
+	if (kfifo_initialized(&port->rx_ring))
+		kfifo_reset(&port->rx_ring);
+	ft260_uart_rx_frame_reset(port);
+	spin_unlock_irq(&port->rx_lock);
 
 	clear_bit(TTY_IO_ERROR, &tty->flags);
 
@@ -2010,11 +5325,43 @@ static int ft260_uart_port_activate(struct tty_port *tport, struct tty_struct *t
 	if (ret)
 		return ret;
 
+	/* Resynchronize the cached configuration with the chip */
+	mutex_lock(&port->lock);
+	port->uart_cfg.report = FT260_SYSTEM_SETTINGS;
+	port->uart_cfg.request = FT260_SET_UART_CONFIG;
+	port->uart_cfg.flow_ctrl = cfg.flow_ctrl;
+	port->uart_cfg.baudrate = cfg.baudrate;
+	port->uart_cfg.data_bit = cfg.data_bit;
+	port->uart_cfg.parity = cfg.parity;
+	port->uart_cfg.stop_bit = cfg.stop_bit;
+	port->uart_cfg.breaking = cfg.breaking;
+	port->uart_cfg_valid = true;
+
+	/* Drop the stale data the chip kept since the port was closed */
+	ret = ft260_uart_chip_reset(port);
+	mutex_unlock(&port->lock);
+	if (ret < 0)
+		hid_err(port->hdev, "failed to reset uart: %d\n", ret);
+
 	baudrate = get_unaligned_le32(&cfg.baudrate);
+
+	/* The kept rate holds the system clock up again until shutdown */
+	ret = ft260_sysclk_set_uart(port, baudrate);
+	if (ret < 0)
+		hid_err(port->hdev, "failed to set system clock for %d baud\n",
+			baudrate);
+
 	if (baudrate > FT260_UART_EN_PW_SAVE_BAUD)
 		ft260_uart_wakeup_workaraund_enable(port, true);
 
-	ft260_dbg("configured baudrate = %d", baudrate);
+	ft260_dbg_uart("configured baudrate = %d", baudrate);
+
+	ret = ft260_hid_feature_report_get(port->hdev, FT260_UART_RI_DCD_STATUS,
+					   (u8 *)&dcd_ri, sizeof(dcd_ri));
+	if (ret < 0)
+		hid_err(port->hdev, "failed to retrieve DCD/RI status\n");
+	else
+		port->dcd_ri = dcd_ri.dcd_ri;
 
 	mod_timer(&port->wakeup_timer, jiffies +
 		  msecs_to_jiffies(FT260_WAKEUP_NEEDED_AFTER_MS));
@@ -2022,11 +5369,37 @@ static int ft260_uart_port_activate(struct tty_port *tport, struct tty_struct *t
 	return 0;
 }
 
+static bool ft260_uart_port_carrier_raised(struct tty_port *tport)
+{
+	struct ft260_device *port =
+		container_of(tport, struct ft260_device, port);
+
+	/* Without the DCD function on its pin, the carrier is always on */
+	if (port->chip->gpio_en & FT260_GPIO_UART_DCD_RI)
+		return true;
+
+	return port->dcd_ri & FT260_UART_DCD;
+}
+
+static void ft260_uart_port_dtr_rts(struct tty_port *tport, bool active)
+{
+	struct ft260_device *port =
+		container_of(tport, struct ft260_device, port);
+	unsigned int mctrl = TIOCM_DTR | TIOCM_RTS;
+
+	ft260_uart_set_mctrl(port, active ? mctrl : 0);
+}
+
 static void ft260_uart_port_destroy(struct tty_port *tport)
 {
 	struct ft260_device *port =
 		container_of(tport, struct ft260_device, port);
 
+	ft260_chip_put(port->chip);
+	kfree(port->rx_frame);
+	kfree(port->rx_ts);
+	kfree(port->uart_wr_buf);
+	kvfree(port->xmit.buf);
 	kfree(port);
 }
 
@@ -2034,9 +5407,342 @@ static const struct tty_port_operations ft260_uart_port_ops = {
 	.shutdown = ft260_uart_port_shutdown,
 	.activate = ft260_uart_port_activate,
 	.destruct = ft260_uart_port_destroy,
+	.carrier_raised = ft260_uart_port_carrier_raised,
+	.dtr_rts = ft260_uart_port_dtr_rts,
+};
+
+#define FT260_UART_ATTR_SHOW(name)					       \
+	static ssize_t name##_show(struct device *kdev,			       \
+				   struct device_attribute *attr, char *buf)   \
+	{								       \
+		struct ft260_device *port = dev_get_drvdata(kdev);	       \
+									       \
+		return scnprintf(buf, PAGE_SIZE, "%u\n", port->name);	       \
+	}
+
+#define FT260_UART_ATTR_STORE(name, min, max)				       \
+	static ssize_t name##_store(struct device *kdev,		       \
+				    struct device_attribute *attr,	       \
+				    const char *buf, size_t count)	       \
+	{								       \
+		struct ft260_device *port = dev_get_drvdata(kdev);	       \
+		unsigned int name;					       \
+									       \
+		if (kstrtouint(buf, 10, &name) || name < (min) ||	       \
+		    name > (max))					       \
+			return -EINVAL;					       \
+		port->name = name;					       \
+		return count;						       \
+	}
+
+FT260_UART_ATTR_SHOW(rx_push_delay_us);
+FT260_UART_ATTR_STORE(rx_push_delay_us, 0, FT260_RX_PUSH_DELAY_MAX_US);
+static DEVICE_ATTR_RW(rx_push_delay_us);
+
+FT260_UART_ATTR_SHOW(rx_push_threshold);
+FT260_UART_ATTR_STORE(rx_push_threshold, 1, FT260_RX_PUSH_THRESHOLD_MAX);
+static DEVICE_ATTR_RW(rx_push_threshold);
+
+FT260_UART_ATTR_SHOW(low_latency);
+
+static ssize_t low_latency_store(struct device *kdev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct ft260_device *port = dev_get_drvdata(kdev);
+	bool enable;
+	int ret;
+
+	if (kstrtobool(buf, &enable))
+		return -EINVAL;
+
+	mutex_lock(&port->port.mutex);
+	ret = ft260_uart_low_latency_set(port, enable);
+	mutex_unlock(&port->port.mutex);
+
+	return ret < 0 ? ret : count;
+}
+static DEVICE_ATTR_RW(low_latency);
+
+FT260_UART_ATTR_SHOW(rx_pushes);
+static DEVICE_ATTR_RO(rx_pushes);
+
+FT260_UART_ATTR_SHOW(keepalive_sent);
+static DEVICE_ATTR_RO(keepalive_sent);
+
+FT260_UART_ATTR_SHOW(keepalive_suppressed);
+static DEVICE_ATTR_RO(keepalive_suppressed);
+
+FT260_UART_ATTR_SHOW(flow_dtr_dsr);
+FT260_UART_ATTR_STORE(flow_dtr_dsr, 0, 1);
+static DEVICE_ATTR_RW(flow_dtr_dsr);
+
+/* Changing the framing discards the partially received frame */
+#define FT260_UART_PACKET_ATTR_STORE(name, min, max)			       \
+	static ssize_t name##_store(struct device *kdev,		       \
+				    struct device_attribute *attr,	       \
+				    const char *buf, size_t count)	       \
+	{								       \
+		struct ft260_device *port = dev_get_drvdata(kdev);	       \
+		unsigned int name;					       \
+									       \
+		if (kstrtouint(buf, 10, &name) || name < min || name > max)    \
+			return -EINVAL;					       \
+									       \
+		spin_lock_irq(&port->rx_lock);				       \
+		port->name = name;					       \
+		ft260_uart_rx_frame_reset(port);			       \
+		spin_unlock_irq(&port->rx_lock);			       \
+		return count;						       \
+	}
+
+FT260_UART_ATTR_SHOW(packet_mode);
+FT260_UART_PACKET_ATTR_STORE(packet_mode, FT260_UART_PACKET_OFF,
+			     FT260_UART_PACKET_LENGTH);
+static DEVICE_ATTR_RW(packet_mode);
+
+FT260_UART_ATTR_SHOW(packet_delimiter);
+FT260_UART_PACKET_ATTR_STORE(packet_delimiter, 0, 0xff);
+static DEVICE_ATTR_RW(packet_delimiter);
+
+FT260_UART_ATTR_SHOW(packet_header);
+FT260_UART_PACKET_ATTR_STORE(packet_header, 1, 2);
+static DEVICE_ATTR_RW(packet_header);
+
+FT260_UART_ATTR_SHOW(packet_timestamp);
+FT260_UART_PACKET_ATTR_STORE(packet_timestamp, 0, 1);
+static DEVICE_ATTR_RW(packet_timestamp);
+
+FT260_UART_ATTR_SHOW(rx_frames);
+static DEVICE_ATTR_RO(rx_frames);
+
+FT260_UART_ATTR_SHOW(rx_frames_dropped);
+static DEVICE_ATTR_RO(rx_frames_dropped);
+
+static const struct attribute_group ft260_uart_attr_group = {
+	.attrs = (struct attribute *[]) {
+		  &dev_attr_rx_push_delay_us.attr,
+		  &dev_attr_rx_push_threshold.attr,
+		  &dev_attr_low_latency.attr,
+		  &dev_attr_rx_pushes.attr,
+		  &dev_attr_flow_dtr_dsr.attr,
+		  &dev_attr_keepalive_sent.attr,
+		  &dev_attr_keepalive_suppressed.attr,
+		  &dev_attr_packet_mode.attr,
+		  &dev_attr_packet_delimiter.attr,
+		  &dev_attr_packet_header.attr,
+		  &dev_attr_packet_timestamp.attr,
+		  &dev_attr_rx_frames.attr,
+		  &dev_attr_rx_frames_dropped.attr,
+		  NULL
+	}
+};
+
+static const struct attribute_group *ft260_uart_attr_groups[] = {
+	&ft260_uart_attr_group,
+	NULL
 };
 
 static struct tty_driver *ft260_tty_driver;
+static struct dentry *ft260_debugfs_root;
+
+static int ft260_flight_show(struct seq_file *m, void *v)
+{
+	static const char * const types[] = {
+		[FT260_FLIGHT_I2C]		= "i2c",
+		[FT260_FLIGHT_I2C_RESET]	= "reset",
+		[FT260_FLIGHT_UART_TX]		= "tx",
+		[FT260_FLIGHT_UART_RX]		= "rx",
+	};
+	struct ft260_device *dev = m->private;
+	struct ft260_flight_rec *rec;
+	unsigned int idx, n;
+
+	idx = atomic_read(&dev->flight_idx);
+	n = min_t(unsigned int, idx, FT260_FLIGHT_RECORDS);
+
+	seq_printf(m, "%s\n", READ_ONCE(dev->flight_frozen) ?
+		   "frozen" : "recording");
+	seq_puts(m, "         time(us)  type  rep addr flag  len status retries  dur(us)    ret\n");
+
+	for (idx -= n; n; idx++, n--) {
+		rec = &dev->flight[idx & (FT260_FLIGHT_RECORDS - 1)];
+		seq_printf(m, "%17lld %5s 0x%02x 0x%02x 0x%02x %4u   0x%02x %7u %8u %6d\n",
+			   ktime_to_us(rec->ts), types[rec->type], rec->report,
+			   rec->addr, rec->flag, rec->len, rec->status,
+			   rec->retries, rec->duration_us, rec->ret);
+	}
+
+	return 0;
+}
+
+static int ft260_flight_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ft260_flight_show, inode->i_private);
+}
+
+/* Any write clears and re-arms the recorder */
+static ssize_t ft260_flight_write(struct file *file, const char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	struct ft260_device *dev =
+		((struct seq_file *)file->private_data)->private;
+
+	ft260_flight_arm(dev);
+
+	return count;
+}
+
+static const struct file_operations ft260_flight_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ft260_flight_open,
+	.read		= seq_read,
+	.write		= ft260_flight_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int ft260_i2c_stats_show(struct seq_file *m, void *v)
+{
+	static const char * const phases[FT260_I2C_PHASES] = {
+		[FT260_I2C_PHASE_OUT]		= "out report",
+		[FT260_I2C_PHASE_STATUS]	= "status poll",
+		[FT260_I2C_PHASE_READ]		= "read wait",
+	};
+	struct ft260_device *dev = m->private;
+	struct ft260_i2c_stats *st = &dev->i2c_stats;
+	int i, j;
+
+	mutex_lock(&dev->lock);
+	seq_printf(m, "xfers:         %llu\n", st->xfers);
+	seq_printf(m, "msgs:          %llu\n", st->msgs);
+	seq_printf(m, "errors:        %llu\n", st->errors);
+	seq_printf(m, "bytes_written: %llu\n", st->bytes_written);
+	seq_printf(m, "bytes_read:    %llu\n", st->bytes_read);
+	seq_printf(m, "status_polls:  %llu\n", st->status_polls);
+	seq_printf(m, "wakeups:       %llu\n", st->wakeups);
+	seq_printf(m, "resets:        %llu\n", st->resets);
+	seq_printf(m, "naks:          %llu\n", st->naks);
+	seq_printf(m, "timeouts:      %llu\n", st->timeouts);
+	seq_printf(m, "clock_switches: %llu\n", st->clock_switches);
+	seq_printf(m, "clock_fallbacks: %llu\n", st->clock_fallbacks);
+	seq_printf(m, "clock_recoveries: %llu\n", st->clock_recoveries);
+
+	for (i = 0; i < FT260_I2C_PHASES; i++) {
+		seq_printf(m, "%s latency (us):\n", phases[i]);
+		for (j = 0; j < FT260_I2C_LAT_BUCKETS; j++) {
+			if (!st->lat_hist[i][j])
+				continue;
+			if (j == 0)
+				seq_printf(m, "%10u %10u\n", 0,
+					   st->lat_hist[i][j]);
+			else
+				seq_printf(m, "%10lu %10u\n", BIT(j - 1),
+					   st->lat_hist[i][j]);
+		}
+	}
+	mutex_unlock(&dev->lock);
+
+	return 0;
+}
+
+static int ft260_i2c_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ft260_i2c_stats_show, inode->i_private);
+}
+
+/* Any write resets the statistics, between the transfers */
+static ssize_t ft260_i2c_stats_write(struct file *file,
+				     const char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	struct ft260_device *dev =
+		((struct seq_file *)file->private_data)->private;
+
+	mutex_lock(&dev->lock);
+	memset(&dev->i2c_stats, 0, sizeof(dev->i2c_stats));
+	mutex_unlock(&dev->lock);
+
+	return count;
+}
+
+static const struct file_operations ft260_i2c_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ft260_i2c_stats_open,
+	.read		= seq_read,
+	.write		= ft260_i2c_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* Upper bound in us of the latency bucket holding the pct percentile */
+static unsigned long ft260_i2c_lat_pct(const u32 *hist, u64 total, int pct)
+{
+	u64 sum = 0;
+	int i;
+
+	for (i = 0; i < FT260_I2C_LAT_BUCKETS; i++) {
+		sum += hist[i];
+		if (sum * 100 >= total * pct)
+			break;
+	}
+
+	return BIT(min(i, FT260_I2C_LAT_BUCKETS - 1));
+}
+
+static int ft260_i2c_targets_show(struct seq_file *m, void *v)
+{
+	struct ft260_device *dev = m->private;
+	struct ft260_i2c_target *t;
+	int addr;
+
+	seq_puts(m, "addr      xfers    written       read   errors     naks arb_lost  p50(us)  p99(us)\n");
+
+	mutex_lock(&dev->lock);
+	for (addr = 0; addr < FT260_I2C_TARGETS; addr++) {
+		t = &dev->i2c_targets[addr];
+		if (!t->xfers)
+			continue;
+		seq_printf(m, "0x%02x %10llu %10llu %10llu %8u %8u %8u %8lu %8lu\n",
+			   addr, t->xfers, t->bytes_written, t->bytes_read,
+			   t->errors, t->naks, t->arb_lost,
+			   ft260_i2c_lat_pct(t->lat_hist, t->xfers, 50),
+			   ft260_i2c_lat_pct(t->lat_hist, t->xfers, 99));
+	}
+	mutex_unlock(&dev->lock);
+
+	return 0;
+}
+
+static int ft260_i2c_targets_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ft260_i2c_targets_show, inode->i_private);
+}
+
+/* Any write clears the table, between the transfers */
+static ssize_t ft260_i2c_targets_write(struct file *file,
+				       const char __user *buf,
+				       size_t count, loff_t *ppos)
+{
+	struct ft260_device *dev =
+		((struct seq_file *)file->private_data)->private;
+
+	mutex_lock(&dev->lock);
+	memset(dev->i2c_targets, 0,
+	       FT260_I2C_TARGETS * sizeof(*dev->i2c_targets));
+	mutex_unlock(&dev->lock);
+
+	return count;
+}
+
+static const struct file_operations ft260_i2c_targets_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ft260_i2c_targets_open,
+	.read		= seq_read,
+	.write		= ft260_i2c_targets_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
 
 static int ft260_i2c_probe(struct ft260_device *dev,
 			   struct ft260_get_system_status_report *cfg)
@@ -2061,9 +5767,28 @@ static int ft260_i2c_probe(struct ft260_device *dev,
 	mutex_init(&dev->lock);
 	init_completion(&dev->wait);
 
+	dev->i2c_wakeup = true;
 	ret = ft260_xfer_status(dev, FT260_I2C_STATUS_BUS_BUSY);
 	if (ret)
 		ft260_i2c_reset(hdev);
+	dev->i2c_clock_default = dev->clock;
+	dev->i2c_clock_set = dev->clock;
+
+	/* Only recorded, the system clock is chosen on the next rate change */
+	mutex_lock(&dev->chip->clock_lock);
+	dev->chip->i2c_khz = dev->clock;
+	mutex_unlock(&dev->chip->clock_lock);
+
+	debugfs_create_file("i2c_stats", 0600, dev->debugfs, dev,
+			    &ft260_i2c_stats_fops);
+
+	dev->i2c_targets = devm_kcalloc(&hdev->dev, FT260_I2C_TARGETS,
+					sizeof(*dev->i2c_targets), GFP_KERNEL);
+	if (dev->i2c_targets)
+		debugfs_create_file("i2c_targets", 0600, dev->debugfs, dev,
+				    &ft260_i2c_targets_fops);
+	else
+		hid_warn(hdev, "no memory for the I2C target table\n");
 
 	i2c_set_adapdata(&dev->adap, dev);
 	ret = i2c_add_adapter(&dev->adap);
@@ -2079,11 +5804,13 @@ static int ft260_i2c_probe(struct ft260_device *dev,
 	ret = sysfs_create_group(&hdev->dev.kobj, &ft260_attr_group);
 	if (ret < 0) {
 		hid_err(hdev, "failed to create sysfs attrs\n");
-		goto err_i2c_free;
+		goto err_gpio_remove;
 	}
 
 	return 0;
 
+err_gpio_remove:
+	ft260_gpio_remove(dev);
 err_i2c_free:
 	i2c_del_adapter(&dev->adap);
 	return ret;
@@ -2098,29 +5825,70 @@ static int ft260_uart_probe(struct ft260_device *dev,
 	int ret;
 
 	INIT_WORK(&dev->wakeup_work, ft260_uart_do_wakeup);
+	kthread_init_work(&dev->tx_work, ft260_uart_tx_work);
+	mutex_init(&dev->tx_lock);
+	spin_lock_init(&dev->tx_worker_lock);
 	ft260_uart_wakeup_workaraund_enable(dev, true);
 	/* Work not started at this point */
 	timer_setup(&dev->wakeup_timer, ft260_uart_start_wakeup, 0);
 
+	spin_lock_init(&dev->rx_lock);
+	hrtimer_init(&dev->rx_push_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	dev->rx_push_timer.function = ft260_uart_rx_push_timeout;
+	dev->rx_push_delay_us = min_t(unsigned int, rx_push_delay_us,
+				      FT260_RX_PUSH_DELAY_MAX_US);
+	dev->rx_push_threshold = clamp_t(unsigned int, rx_push_threshold, 1,
+					 FT260_RX_PUSH_THRESHOLD_MAX);
+	dev->packet_delimiter = '\n';
+	dev->packet_header = 1;
+
+	if (cfg->gpioa_func == FT260_MFPIN_TX_ACTIVE)
+		dev->rs485.flags = SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND |
+				   SER_RS485_RX_DURING_TX;
+
 	tty_port_init(&dev->port);
 	dev->port.ops = &ft260_uart_port_ops;
 
 	ret = ft260_uart_add_port(dev);
 	if (ret) {
 		hid_err(hdev, "failed to add port\n");
+		ft260_probe_cleanup(dev);
+		ft260_uart_port_put(dev);
 		return ret;
 	}
-	devt = tty_port_register_device_attr(&dev->port,
-					     ft260_tty_driver,
-					     dev->index, &hdev->dev,
-					     dev, NULL);
+
+	if (low_latency) {
+		mutex_lock(&dev->port.mutex);
+		ret = ft260_uart_low_latency_set(dev, true);
+		mutex_unlock(&dev->port.mutex);
+		if (ret)
+			hid_warn(hdev, "low latency mode not enabled: %d\n", ret);
+	}
+
+	/*
+	 * serdev looks for client devices below the firmware node of the
+	 * host device. The HID device has none of its own, so borrow the
+	 * node of the USB interface the FT260 UART is described on.
+	 */
+	if (!dev_fwnode(&hdev->dev) && hdev->dev.parent)
+		device_set_node(&hdev->dev, dev_fwnode(hdev->dev.parent));
+
+	devt = tty_port_register_device_attr_serdev(&dev->port,
+						    ft260_tty_driver,
+						    dev->index, &hdev->dev,
+						    dev, ft260_uart_attr_groups);
 	if (IS_ERR(devt)) {
 		hid_err(hdev, "failed to register tty port\n");
 		ret = PTR_ERR(devt);
 		goto err_register_tty;
 	}
-	hid_info(hdev, "registering device /dev/%s%d\n",
-		ft260_tty_driver->name, dev->index);
+	dev->serdev = dev->port.client_ops != &tty_port_default_client_ops;
+	if (dev->serdev)
+		hid_info(hdev, "registering serdev controller for %s%d\n",
+			 ft260_tty_driver->name, dev->index);
+	else
+		hid_info(hdev, "registering device /dev/%s%d\n",
+			 ft260_tty_driver->name, dev->index);
 
 	/* Configure UART to 9600n8 */
 	req.report	= FT260_SYSTEM_SETTINGS;
@@ -2137,6 +5905,12 @@ static int ft260_uart_probe(struct ft260_device *dev,
 		hid_err(hdev, "failed to configure uart: %d\n", ret);
 		goto err_hid_report;
 	}
+	dev->uart_cfg = req;
+	dev->uart_cfg_valid = true;
+
+	mutex_lock(&dev->chip->clock_lock);
+	dev->chip->uart_port = dev;
+	mutex_unlock(&dev->chip->clock_lock);
 
 	if (dev->iface_id == 0) {
 		ret = ft260_gpio_init(dev, cfg);
@@ -2146,15 +5920,19 @@ static int ft260_uart_probe(struct ft260_device *dev,
 		ret = sysfs_create_group(&hdev->dev.kobj, &ft260_attr_group);
 		if (ret < 0) {
 			hid_err(hdev, "failed to create sysfs attrs\n");
+			ft260_gpio_remove(dev);
 			goto err_hid_report;
 		}
 	}
 
+	ft260_uart_debugfs_init(dev);
+
 	return 0;
 
 err_hid_report:
 	tty_port_unregister_device(&dev->port, ft260_tty_driver, dev->index);
 err_register_tty:
+	ft260_probe_cleanup(dev);
 	ft260_uart_port_remove(dev);
 	return ret;
 }
@@ -2162,8 +5940,6 @@ err_register_tty:
 static int ft260_probe(struct hid_device *hdev, const struct hid_device_id *id)
 {
 	struct ft260_device *dev;
-	struct ft260_get_chip_version_report version;
-	struct ft260_get_system_status_report cfg;
 	int ret;
 
 	if (!hid_is_usb(hdev))
@@ -2179,6 +5955,7 @@ static int ft260_probe(struct hid_device *hdev, const struct hid_device_id *id)
 	}
 	hid_set_drvdata(hdev, dev);
 	dev->hdev = hdev;
+	ft260_flight_arm(dev);
 
 	ret = hid_parse(hdev);
 	if (ret) {
@@ -2192,41 +5969,74 @@ static int ft260_probe(struct hid_device *hdev, const struct hid_device_id *id)
 		goto hid_fail;
 	}
 
-	ret = hid_hw_open(hdev);
-	if (ret) {
-		hid_err(hdev, "failed to open HID HW\n");
+	ret = ft260_chip_get(dev);
+	if (ret)
 		goto err_hid_stop;
-	}
 
-	ret = ft260_hid_feature_report_get(hdev, FT260_CHIP_VERSION,
-					   (u8 *)&version, sizeof(version));
-	if (ret < 0) {
-		hid_err(hdev, "failed to retrieve chip version\n");
-		goto err_hid_close;
-	}
+	ret = ft260_urb_in_init(dev);
+	if (ret)
+		goto err_chip_put;
 
-	hid_info(hdev, "chip code: %02x%02x %02x%02x\n",
-		 version.chip_code[0], version.chip_code[1],
-		 version.chip_code[2], version.chip_code[3]);
+	if (!dev->urb_in_en) {
+		ret = hid_hw_open(hdev);
+		if (ret) {
+			hid_err(hdev, "failed to open HID HW\n");
+			goto err_chip_put;
+		}
+	}
 
 	mutex_init(&dev->lock);
 	init_completion(&dev->wait);
 
-	ret = ft260_get_interface_type(dev, &cfg);
-	if (ret <= FT260_IFACE_NONE)
+	ret = ft260_get_interface_type(dev, &dev->chip->cfg);
+	if (ret <= FT260_IFACE_NONE) {
+		ret = -ENODEV;
 		goto err_hid_close;
+	}
 
-	if (ret == FT260_IFACE_I2C)
-		ret = ft260_i2c_probe(dev, &cfg);
-	else
-		ret = ft260_uart_probe(dev, &cfg);
-	if (ret)
-		goto err_hid_close;
+	dev->debugfs = debugfs_create_dir(dev_name(&hdev->dev),
+					  ft260_debugfs_root);
+	debugfs_create_file("flight_recorder", 0600, dev->debugfs, dev,
+			    &ft260_flight_fops);
+
+	if (dev->urb_in_en) {
+		debugfs_create_file_unsafe("rx_urb_interval", 0644,
+					   dev->debugfs, dev,
+					   &ft260_rx_urb_interval_fops);
+		debugfs_create_u32("urb_in_errors", 0444, dev->debugfs,
+				   &dev->urb_in_errors);
+	}
+
+	if (ft260_urb_out_init(dev))
+		hid_warn(hdev, "failed to allocate URBs, direct URBs disabled\n");
+
+	if (ft260_ctrl_init(dev))
+		hid_warn(hdev, "failed to allocate control URBs\n");
+
+	if (ret == FT260_IFACE_I2C) {
+		ret = ft260_i2c_probe(dev, &dev->chip->cfg);
+		if (ret) {
+			ft260_probe_cleanup(dev);
+			goto err_chip_put;
+		}
+	} else {
+		/*
+		 * On failure, the port destructor releases the device, so
+		 * ft260_uart_probe() undoes the common setup by itself.
+		 */
+		ret = ft260_uart_probe(dev, &dev->chip->cfg);
+		if (ret) {
+			hid_hw_stop(hdev);
+			return ret;
+		}
+	}
 
 	return 0;
 
 err_hid_close:
-	hid_hw_close(hdev);
+	ft260_hw_close(dev);
+err_chip_put:
+	ft260_chip_put(dev->chip);
 err_hid_stop:
 	hid_hw_stop(hdev);
 hid_fail:
@@ -2238,12 +6048,30 @@ alloc_fail:
 static void ft260_remove(struct hid_device *hdev)
 {
 	struct ft260_device *dev = hid_get_drvdata(hdev);
+	bool hw_opened;
 
 	if (!dev)
 		return;
 
+	debugfs_remove_recursive(dev->debugfs);
+	ft260_gpio_remove(dev);
+	hw_opened = !dev->urb_in_en;
+
 	if (dev->iface_type == FT260_IFACE_UART) {
+		timer_delete_sync(&dev->wakeup_timer);
 		cancel_work_sync(&dev->wakeup_work);
+
+		/* The transmitter falls back to hid_hw_output_report() */
+		mutex_lock(&dev->tx_lock);
+		ft260_urb_out_free(dev);
+		mutex_unlock(&dev->tx_lock);
+		ft260_urb_in_free(dev);
+		ft260_ctrl_free(dev);
+
+		mutex_lock(&dev->chip->clock_lock);
+		dev->chip->uart_port = NULL;
+		mutex_unlock(&dev->chip->clock_lock);
+
 		tty_port_unregister_device(&dev->port, ft260_tty_driver,
 					   dev->index);
 		ft260_uart_port_remove(dev);
@@ -2254,10 +6082,15 @@ static void ft260_remove(struct hid_device *hdev)
 	} else {
 		sysfs_remove_group(&hdev->dev.kobj, &ft260_attr_group);
 		i2c_del_adapter(&dev->adap);
+		ft260_urb_out_free(dev);
+		ft260_urb_in_free(dev);
+		ft260_ctrl_free(dev);
+		ft260_chip_put(dev->chip);
 		kfree(dev);
 	}
 
-	hid_hw_close(hdev);
+	if (hw_opened)
+		hid_hw_close(hdev);
 	hid_hw_stop(hdev);
 }
 
@@ -2267,10 +6100,13 @@ static int ft260_raw_event(struct hid_device *hdev, struct hid_report *report,
 	struct ft260_device *dev = hid_get_drvdata(hdev);
 	struct ft260_input_report *xfer = (void *)data;
 
+	WRITE_ONCE(dev->chip->last_activity, jiffies);
+	trace_ft260_input_report(hdev, xfer->report, xfer->length);
+
 	if (xfer->report >= FT260_I2C_REPORT_MIN &&
 	    xfer->report <= FT260_I2C_REPORT_MAX) {
-		ft260_dbg("i2c resp: rep %#02x len %d\n", xfer->report,
-			  xfer->length);
+		ft260_dbg_i2c("i2c resp: rep %#02x len %d\n", xfer->report,
+			      xfer->length);
 
 		if ((dev->read_buf == NULL) ||
 		    (xfer->length > dev->read_len - dev->read_idx)) {
@@ -2293,8 +6129,16 @@ static int ft260_raw_event(struct hid_device *hdev, struct hid_report *report,
 		return -EBADR;
 	} else if (xfer->report >= FT260_UART_REPORT_MIN &&
 		   xfer->report <= FT260_UART_REPORT_MAX) {
-		return ft260_uart_receive_chars(dev, xfer->data, xfer->length);
+		ft260_flight_record(dev, FT260_FLIGHT_UART_RX, xfer->report, 0,
+				    0, xfer->length, 0, 0, 0);
+		return ft260_uart_receive_chars(dev, xfer->data, xfer->length,
+						ktime_get());
 	} else if (xfer->report == FT260_UART_INTERRUPT_STATUS) {
+		struct ft260_uart_interrupt_status_report *intr = (void *)data;
+
+		if (dev->iface_type == FT260_IFACE_UART &&
+		    size >= sizeof(*intr))
+			ft260_uart_modem_status(dev, intr->dcd_ri);
 		return 0;
 	}
 	hid_err(hdev, "unhandled report %#02x\n", xfer->report);
@@ -2340,6 +6184,11 @@ static int __init ft260_driver_init(void)
 		goto err_reg_driver;
 	}
 
+	ft260_debugfs_root = debugfs_create_dir("ft260", NULL);
+
+	/* The keys start disabled, also when the DEBUG build enables all */
+	ft260_dbg_apply(ft260_debug);
+
 	ret = hid_register_driver(&ft260_driver);
 	if (ret) {
 		pr_err("hid_register_driver failed: %d\n", ret);
@@ -2349,6 +6198,7 @@ static int __init ft260_driver_init(void)
 	return 0;
 
 err_reg_hid:
+	debugfs_remove_recursive(ft260_debugfs_root);
 	tty_unregister_driver(ft260_tty_driver);
 err_reg_driver:
 	tty_driver_kref_put(ft260_tty_driver);
@@ -2359,6 +6209,7 @@ err_reg_driver:
 static void __exit ft260_driver_exit(void)
 {
 	hid_unregister_driver(&ft260_driver);
+	debugfs_remove_recursive(ft260_debugfs_root);
 	tty_unregister_driver(ft260_tty_driver);
 	tty_driver_kref_put(ft260_tty_driver);
 }